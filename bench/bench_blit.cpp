@@ -0,0 +1,122 @@
+// Measures the two ways an interpreter can draw an APal image under the
+// Current Palette: decoding a pre-built replacement PNG (what BPal
+// provides), or expanding the APal image’s indices, decoded once, with
+// blit.h. Synthetic indexed images of a few sizes and palette sizes are
+// used; PNG decoding is done by Qt, and includes conversion to ARGB32 as
+// an interpreter would need.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <random>
+#include <span>
+#include <vector>
+
+#include <QBuffer>
+#include <QByteArray>
+#include <QIODevice>
+#include <QImage>
+
+#include "blit.h"
+
+// Return the best time in nanoseconds of “repeats” runs of “f”.
+template <typename F>
+static double best_of(int repeats, F &&f)
+{
+    using clock = std::chrono::steady_clock;
+    double best = 0;
+
+    for (int r = 0; r < repeats; r++) {
+        auto start = clock::now();
+        f();
+        double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        if (r == 0 || ns < best) {
+            best = ns;
+        }
+    }
+
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    int repeats = argc > 1 ? std::atoi(argv[1]) : 20;
+    std::uint64_t checksum = 0;
+    bool mismatch = false;
+
+    std::cout << std::format("{:>10} {:>6} {:>8} {:>12} {:>10}\n", "size", "colors", "method", "us/image", "ns/pixel");
+
+    for (auto [width, height] : {std::pair{320, 200}, {640, 480}, {1280, 960}}) {
+        for (int colors : {16, 256}) {
+            std::mt19937 rng(width * colors);
+
+            QImage apal(width, height, QImage::Format_Indexed8);
+            QList<QRgb> apal_colors(colors), current_colors(colors);
+            for (int i = 0; i < colors; i++) {
+                apal_colors[i] = 0xff000000 | (rng() & 0xffffff);
+                current_colors[i] = 0xff000000 | (rng() & 0xffffff);
+            }
+            apal.setColorTable(apal_colors);
+
+            // Runs of a few pixels, roughly as in drawn artwork.
+            std::vector<std::uint8_t> indices(std::size_t(width) * height);
+            for (std::size_t i = 0; i < indices.size(); ) {
+                auto run = 1 + rng() % 8;
+                auto index = rng() % colors;
+                for (std::size_t j = 0; j < run && i < indices.size(); j++, i++) {
+                    indices[i] = index;
+                }
+            }
+            for (int y = 0; y < height; y++) {
+                std::copy_n(indices.data() + std::size_t(y) * width, width, apal.scanLine(y));
+            }
+
+            auto palette = blit::merge(std::span<const QRgb>(apal_colors), std::span<const QRgb>(current_colors));
+
+            QImage replacement = apal;
+            replacement.setColorTable({palette.begin(), palette.begin() + colors});
+            QByteArray png;
+            QBuffer buffer(&png);
+            buffer.open(QIODevice::WriteOnly);
+            replacement.save(&buffer, "PNG", 100);
+
+            auto report = [&](const char *method, double ns) {
+                std::cout << std::format("{:>10} {:>6} {:>8} {:>12.1f} {:>10.3f}\n",
+                        std::format("{}x{}", width, height), colors, method, ns / 1000, ns / indices.size());
+            };
+
+            report("png", best_of(repeats, [&] {
+                QImage decoded;
+                decoded.loadFromData(reinterpret_cast<const uchar *>(png.constData()), png.size(), "PNG");
+                auto argb = decoded.convertToFormat(QImage::Format_ARGB32);
+                checksum += argb.constScanLine(height - 1)[0];
+            }));
+
+            std::vector<std::uint32_t> expected(indices.size());
+            blit::blit(indices, palette, expected, blit::Kernel::scalar);
+
+            for (auto [kernel, name] : {std::pair{blit::Kernel::scalar, "scalar"}, {blit::Kernel::ssse3, "ssse3"}, {blit::Kernel::avx2, "avx2"}}) {
+                if (!blit::supported(kernel)) {
+                    continue;
+                }
+
+                std::vector<std::uint32_t> out(indices.size());
+                report(name, best_of(repeats, [&] {
+                    blit::blit(indices, palette, out, kernel);
+                    checksum += out.back();
+                }));
+
+                if (out != expected) {
+                    std::cerr << std::format("{} kernel disagrees with scalar kernel\n", name);
+                    mismatch = true;
+                }
+            }
+        }
+    }
+
+    std::cerr << std::format("checksum: {}\n", checksum);
+
+    return mismatch ? 1 : 0;
+}
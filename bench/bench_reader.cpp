@@ -0,0 +1,191 @@
+// Measures the per-plot cost of consulting the BPal table, as an
+// interpreter does for every picture it draws. A synthetic Blorb with a
+// full (palette, APal) product is built in memory, and a random sequence
+// of plots, mixing current palette images and APal images, is replayed
+// against bpal_reader.h and against the obvious alternatives: scanning
+// the BPal entries, std::map, std::unordered_map, and bpix.h’s matrix.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bpal_reader.h"
+#include "bpix.h"
+#include "synthetic.h"
+
+struct BPalEntry {
+    std::uint32_t palette;
+    std::uint32_t requested;
+    std::uint32_t id;
+};
+
+struct Synthetic {
+    std::vector<unsigned char> blorb;
+    std::vector<unsigned char> bpix;
+    std::vector<BPalEntry> bpal;
+    std::uint32_t palettes;
+    std::uint32_t apal;
+};
+
+// Pictures 1 to “palettes” are current palette images, the next “apal”
+// are APal images, and replacements follow, one for every pair. Images
+// are tiny: only the tables are of interest here.
+static Synthetic synthetic_blorb(std::uint32_t palettes, std::uint32_t apal)
+{
+    synthetic::Options options;
+    options.palettes = palettes;
+    options.apal = apal;
+    options.width = 8;
+    options.height = 8;
+    options.colors = 4;
+    options.replacements = true;
+
+    Synthetic s;
+    s.blorb = synthetic::blorb(options);
+    s.palettes = palettes;
+    s.apal = apal;
+
+    for (std::uint32_t p = 1; p <= palettes; p++) {
+        for (std::uint32_t a = palettes + 1; a <= palettes + apal; a++) {
+            s.bpal.emplace_back(p, a, synthetic::replacement(options, p, a));
+        }
+    }
+
+    synthetic::write32(s.bpix, palettes);
+    synthetic::write32(s.bpix, apal);
+    synthetic::write32(s.bpix, 4);
+    for (std::uint32_t p = 1; p <= palettes; p++) {
+        synthetic::write32(s.bpix, p);
+    }
+    for (std::uint32_t a = palettes + 1; a <= palettes + apal; a++) {
+        synthetic::write32(s.bpix, a);
+    }
+    for (const auto &entry : s.bpal) {
+        synthetic::write32(s.bpix, entry.id);
+    }
+
+    return s;
+}
+
+// Replay “plots” through “lookup”, tracking the current palette as an
+// interpreter would, and return the mean time per plot in nanoseconds.
+template <typename Lookup>
+static double replay(const Synthetic &s, std::span<const std::uint32_t> plots, int repeats, std::uint64_t &checksum, Lookup &&lookup)
+{
+    using clock = std::chrono::steady_clock;
+    double best = 0;
+
+    for (int r = 0; r < repeats; r++) {
+        std::optional<std::uint32_t> current;
+        auto start = clock::now();
+
+        for (const auto number : plots) {
+            if (number <= s.palettes) {
+                current = number;
+                checksum += number;
+            } else if (current.has_value()) {
+                checksum += lookup(*current, number);
+            } else {
+                checksum += number;
+            }
+        }
+
+        double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count() / plots.size();
+        if (r == 0 || ns < best) {
+            best = ns;
+        }
+    }
+
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    int repeats = argc > 1 ? std::atoi(argv[1]) : 5;
+    std::uint64_t checksum = 0;
+
+    std::cout << std::format("{:>8} {:>6} {:>8} {:>12} {:>12}\n", "palettes", "apal", "entries", "method", "ns/plot");
+
+    for (auto [palettes, apal] : {std::pair{10u, 10u}, {100u, 50u}, {400u, 200u}}) {
+        auto s = synthetic_blorb(palettes, apal);
+
+        // One plot in five changes the current palette.
+        std::mt19937 rng(palettes * apal);
+        std::vector<std::uint32_t> plots(1'000'000);
+        for (auto &number : plots) {
+            number = rng() % 5 == 0 ? 1 + rng() % palettes : palettes + 1 + rng() % apal;
+        }
+
+        auto report = [&](const char *method, double ns) {
+            std::cout << std::format("{:>8} {:>6} {:>8} {:>12} {:>12.2f}\n", palettes, apal, s.bpal.size(), method, ns);
+        };
+
+        bpal_reader::Blorb reader{std::span<const unsigned char>(s.blorb)};
+        {
+            using clock = std::chrono::steady_clock;
+            double best = 0;
+            for (int r = 0; r < repeats; r++) {
+                reader.reset();
+                auto start = clock::now();
+                for (const auto number : plots) {
+                    checksum += reader.plot(number);
+                }
+                double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count() / plots.size();
+                if (r == 0 || ns < best) {
+                    best = ns;
+                }
+            }
+            report("plot()", best);
+        }
+
+        report("lookup()", replay(s, plots, repeats, checksum, [&reader](auto current, auto requested) {
+            return reader.lookup(current, requested);
+        }));
+
+        bpix::Table table(s.bpix);
+        report("bpix", replay(s, plots, repeats, checksum, [&table](auto current, auto requested) {
+            return table.lookup(current, requested);
+        }));
+
+        std::unordered_map<std::uint64_t, std::uint32_t> unordered;
+        std::map<std::pair<std::uint32_t, std::uint32_t>, std::uint32_t> ordered;
+        for (const auto &entry : s.bpal) {
+            unordered.emplace((std::uint64_t(entry.palette) << 32) | entry.requested, entry.id);
+            ordered.emplace(std::pair(entry.palette, entry.requested), entry.id);
+        }
+
+        report("unordered", replay(s, plots, repeats, checksum, [&unordered](auto current, auto requested) {
+            auto it = unordered.find((std::uint64_t(current) << 32) | requested);
+            return it == unordered.end() ? 0 : it->second;
+        }));
+
+        report("map", replay(s, plots, repeats, checksum, [&ordered](auto current, auto requested) {
+            auto it = ordered.find({current, requested});
+            return it == ordered.end() ? 0 : it->second;
+        }));
+
+        // A linear scan is far slower, so it gets a fraction of the plots.
+        report("scan", replay(s, std::span(plots).first(plots.size() / 100), 1, checksum, [&s](auto current, auto requested) {
+            for (const auto &entry : s.bpal) {
+                if (entry.palette == current && entry.requested == requested) {
+                    return entry.id;
+                }
+            }
+            return 0u;
+        }));
+    }
+
+    std::cerr << std::format("checksum: {}\n", checksum);
+
+    return 0;
+}
@@ -0,0 +1,253 @@
+// Replays a sequence of picture draws as an interpreter would, to judge
+// bpal’s output choices by their cost to the player. Each draw follows
+// the “Current Palette” rules of Blorb.md through bpal_reader.h, fetches
+// the picture to draw and decodes it. The same Blorb is written with each
+// layout and BPal table format, and is also served by LazyReplacements,
+// which converts pairs on first use instead.
+//
+// The Blorb is given with -b, or comes from synthetic.h, and the draws
+// either from a draw trace file given with -d (as for bpal’s -d) or from
+// synthetic scenes: a palette image, then a few APal images from a
+// neighborhood of picture numbers, as in a room’s artwork. Draws of
+// pictures the Blorb does not have are skipped, and counted.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <QImage>
+
+#include <getopt.h>
+
+#include "bpal_reader.h"
+#include "libbpal.h"
+#include "synthetic.h"
+
+struct Replay {
+    std::vector<double> latencies;
+    std::size_t bytes = 0;
+
+    // Distinct pages of the file holding pictures drawn, and the sum
+    // over draws of the pages each one touched.
+    std::size_t pages = 0;
+    std::size_t page_touches = 0;
+
+    std::uint64_t checksum = 0;
+};
+
+constexpr std::size_t page_size = 4096;
+
+static void decode(std::span<const unsigned char> png, Replay &replay)
+{
+    QImage image;
+    if (!image.loadFromData(png.data(), png.size(), "PNG")) {
+        std::abort();
+    }
+    replay.checksum += image.width();
+}
+
+// Draw “draws” from a Blorb with BPal tables, through bpal_reader.h.
+static Replay replay_reader(std::span<const unsigned char> blorb, std::span<const std::uint32_t> draws)
+{
+    using clock = std::chrono::steady_clock;
+    bpal_reader::Blorb reader(blorb);
+    std::vector<bool> touched((blorb.size() + page_size - 1) / page_size);
+    Replay replay;
+
+    for (const auto number : draws) {
+        auto start = clock::now();
+        auto png = reader.picture(reader.plot(number));
+        decode(png, replay);
+        replay.latencies.push_back(std::chrono::duration<double, std::micro>(clock::now() - start).count());
+
+        replay.bytes += png.size();
+        auto offset = static_cast<std::size_t>(png.data() - blorb.data());
+        for (auto page = offset / page_size; page <= (offset + png.size() - 1) / page_size; page++) {
+            replay.pages += !touched[page];
+            replay.page_touches++;
+            touched[page] = true;
+        }
+    }
+
+    return replay;
+}
+
+// Draw “draws” from an unmodified Blorb, converting replacements when
+// first needed and tracking the current palette here; “palettes” is
+// sorted.
+static Replay replay_lazy(std::span<const unsigned char> blorb, std::span<const std::uint32_t> palettes, std::span<const std::uint32_t> draws)
+{
+    using clock = std::chrono::steady_clock;
+    auto blorb_data = bpal::parse(blorb);
+    bpal::LazyReplacements lazy(blorb, bpal::ImageFormat::png, std::size_t(64) << 20);
+    std::optional<std::uint32_t> current;
+    Replay replay;
+
+    for (const auto number : draws) {
+        auto start = clock::now();
+        std::span<const unsigned char> png;
+        std::shared_ptr<const bpal::Image> replacement;
+
+        if (std::ranges::binary_search(palettes, number)) {
+            current = number;
+        } else if (current.has_value()) {
+            replacement = lazy.get(*current, number);
+        }
+
+        if (replacement != nullptr) {
+            png = replacement->data;
+        } else {
+            png = blorb_data.picts.at(number).data;
+        }
+
+        decode(png, replay);
+        replay.latencies.push_back(std::chrono::duration<double, std::micro>(clock::now() - start).count());
+        replay.bytes += png.size();
+    }
+
+    return replay;
+}
+
+// Scenes of a palette image and 4 to 11 APal images near each other.
+static std::vector<std::uint32_t> synthetic_draws(const synthetic::Options &options, std::size_t count)
+{
+    std::mt19937 rng(options.seed);
+    std::vector<std::uint32_t> draws;
+
+    while (draws.size() < count) {
+        draws.push_back(1 + rng() % options.palettes);
+
+        auto room = rng() % options.apal;
+        for (auto n = 4 + rng() % 8; n > 0; n--) {
+            draws.push_back(options.palettes + 1 + ((room + rng() % 6) % options.apal));
+        }
+    }
+
+    return draws;
+}
+
+static std::string read_file(const char *filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        std::cerr << std::format("unable to open {}\n", filename);
+        std::exit(1);
+    }
+
+    return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+[[noreturn]]
+static void usage()
+{
+    std::cerr << "usage: bench_replay [-d trace] [-b blorb.blb]\n";
+    std::exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *trace_path = nullptr;
+    const char *blorb_path = nullptr;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:b:")) != -1) {
+        switch (c) {
+        case 'd':
+            trace_path = optarg;
+            break;
+        case 'b':
+            blorb_path = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind != argc) {
+        usage();
+    }
+
+    // Small APal images keep compressing every pair quick.
+    synthetic::Options options;
+    options.palettes = 8;
+    options.apal = 16;
+    options.width = 160;
+    options.height = 100;
+
+    std::vector<unsigned char> blorb;
+    if (blorb_path != nullptr) {
+        auto text = read_file(blorb_path);
+        blorb.assign(text.begin(), text.end());
+    } else {
+        blorb = synthetic::blorb(options);
+    }
+
+    std::vector<std::uint32_t> draws;
+    if (trace_path != nullptr) {
+        draws = bpal::parse_draw_trace(read_file(trace_path));
+    } else {
+        draws = synthetic_draws(options, 20000);
+    }
+
+    // Since a trace may come from another game, or another release of
+    // the same one, it may draw pictures this Blorb does not have.
+    auto blorb_data = bpal::parse(blorb);
+    auto skipped = std::erase_if(draws, [&blorb_data](std::uint32_t number) {
+        return !blorb_data.picts.contains(number);
+    });
+    if (skipped != 0) {
+        std::cerr << std::format("skipping {} draws of pictures not in the Blorb\n", skipped);
+    }
+    if (draws.empty()) {
+        std::cerr << "no draws to replay\n";
+        return 1;
+    }
+
+    std::cout << std::format("{:>16} {:>10} {:>8} {:>8} {:>10} {:>10} {:>10} {:>12} {:>8} {:>10}\n",
+            "output", "bytes", "draws", "skipped", "mean us", "p50 us", "p99 us", "bytes/draw", "pages", "pages/draw");
+
+    auto report = [&](const std::string &name, std::size_t size, Replay replay) {
+        auto &latencies = replay.latencies;
+        auto mean = std::accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size();
+        std::ranges::sort(latencies);
+
+        std::cout << std::format("{:>16} {:>10} {:>8} {:>8} {:>10.2f} {:>10.2f} {:>10.2f} {:>12.0f} {:>8} {:>10.2f}\n",
+                name, size, draws.size(), skipped, mean, latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100],
+                static_cast<double>(replay.bytes) / draws.size(), replay.pages, static_cast<double>(replay.page_touches) / draws.size());
+        std::cerr << std::format("checksum: {}\n", replay.checksum);
+    };
+
+    // One Context for all outputs, so that each pair is converted and
+    // compressed once.
+    bpal::Context context;
+
+    for (auto [layout, layout_name] : {std::pair{bpal::Layout::ids, "ids"}, {bpal::Layout::locality, "locality"}}) {
+        for (auto [table_format, table_name] : {std::pair{bpal::TableFormat::list, "list"}, {bpal::TableFormat::matrix, "matrix"}}) {
+            bpal::JobOptions job_options;
+            job_options.layout = layout;
+            job_options.table_format = table_format;
+
+            auto output = bpal::process(blorb, job_options, context).blorb;
+            report(std::format("{}/{}", layout_name, table_name), output.size(), replay_reader(output, draws));
+        }
+    }
+
+    auto palettes = bpal::plan(blorb_data).palettes;
+    std::ranges::sort(palettes);
+    report("lazy", blorb.size(), replay_lazy(blorb, palettes, draws));
+
+    return 0;
+}
@@ -0,0 +1,156 @@
+// Runs bpal end to end on synthetic Blorbs (see synthetic.h) of growing
+// numbers of current palette and APal images, with growing numbers of
+// threads, and reports throughput and scaling efficiency: the speedup
+// over one thread, divided by the number of threads. Each run uses a
+// fresh Context, so nothing is cached from one run to the next.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <getopt.h>
+
+#include "libbpal.h"
+#include "synthetic.h"
+
+[[noreturn]]
+static void usage()
+{
+    std::cerr << "usage: bench_scaling [options]\n"
+                 "\n"
+                 "options:\n"
+                 "  -g palettesxapal           a size of Blorb to run; may be repeated\n"
+                 "                             (5x10, 10x20 and 20x40)\n"
+                 "  -j threads                 a number of threads to run with; may be\n"
+                 "                             repeated (powers of two up to one per\n"
+                 "                             hardware thread)\n"
+                 "  -n repeats                 runs of each, of which the best is kept (3)\n"
+                 "  -s widthxheight            size of APal images (160x100)\n"
+                 "  -c colors                  colors in each palette (256)\n"
+                 "  -v fraction                fraction of palettes with colors of their own (1)\n"
+                 "  -e bytes                   bundle a story file of at least this size\n"
+                 "  -r seed                    random seed (1)\n";
+    std::exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int repeats = 3;
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> sizes;
+    std::vector<unsigned int> thread_counts;
+
+    // Small APal images keep the largest runs to a few minutes with
+    // oxipng’s highest preset.
+    synthetic::Options options;
+    options.width = 160;
+    options.height = 100;
+
+    auto number = [](const char *arg) {
+        char *end;
+        auto n = std::strtoul(arg, &end, 10);
+        if (end == arg || *end != '\0' || n == 0) {
+            usage();
+        }
+        return n;
+    };
+
+    int c;
+    while ((c = getopt(argc, argv, "g:j:n:s:c:v:e:r:")) != -1) {
+        switch (c) {
+        case 'g': {
+            char *end;
+            auto palettes = std::strtoul(optarg, &end, 10);
+            if (end == optarg || *end != 'x' || palettes == 0) {
+                usage();
+            }
+            sizes.emplace_back(palettes, number(end + 1));
+            break;
+        }
+        case 'j':
+            thread_counts.push_back(number(optarg));
+            break;
+        case 'n':
+            repeats = number(optarg);
+            break;
+        default:
+            if (!synthetic::parse_option(c, optarg, options)) {
+                usage();
+            }
+        }
+    }
+
+    if (optind != argc) {
+        usage();
+    }
+
+    if (sizes.empty()) {
+        sizes = {{5, 10}, {10, 20}, {20, 40}};
+    }
+
+    if (thread_counts.empty()) {
+        auto hardware = std::max(1U, std::thread::hardware_concurrency());
+        for (unsigned int threads = 1; threads < hardware; threads *= 2) {
+            thread_counts.push_back(threads);
+        }
+        thread_counts.push_back(hardware);
+    }
+
+    // Speedups are over one thread; if that is not among the numbers of
+    // threads run, the smallest of them is taken to scale perfectly.
+    std::ranges::sort(thread_counts);
+
+    std::cout << std::format("{:>8} {:>6} {:>6} {:>8} {:>8} {:>10} {:>10} {:>10} {:>8} {:>10}\n",
+            "palettes", "apal", "pairs", "unique", "threads", "seconds", "pairs/s", "unique/s", "speedup", "efficiency");
+
+    for (auto [palettes, apal] : sizes) {
+        options.palettes = palettes;
+        options.apal = apal;
+        auto blorb = synthetic::blorb(options);
+
+        bpal::JobOptions job_options;
+        std::vector<unsigned char> story;
+        if (options.exec_size != 0) {
+            story = synthetic::story(options);
+            job_options.exec = story;
+        }
+
+        double baseline = 0;
+
+        for (const auto threads : thread_counts) {
+            double best = 0;
+            std::size_t unique = 0;
+
+            for (int r = 0; r < repeats; r++) {
+                bpal::Options context_options;
+                context_options.threads = threads;
+                bpal::Context context(std::move(context_options));
+
+                auto start = std::chrono::steady_clock::now();
+                auto output = bpal::process(blorb, job_options, context);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                unique = output.state.replacements.size();
+                if (r == 0 || seconds < best) {
+                    best = seconds;
+                }
+            }
+
+            if (threads == thread_counts.front()) {
+                baseline = best * threads;
+            }
+
+            auto pairs = palettes * apal;
+            auto speedup = baseline / best;
+            std::cout << std::format("{:>8} {:>6} {:>6} {:>8} {:>8} {:>10.3f} {:>10.1f} {:>10.1f} {:>8.2f} {:>10.2f}\n",
+                    palettes, apal, pairs, unique, threads, best, pairs / best, unique / best, speedup, speedup / threads);
+        }
+    }
+
+    return 0;
+}
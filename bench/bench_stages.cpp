@@ -0,0 +1,140 @@
+// Measures each stage of bpal on its own, so that a Qt or oxipng upgrade
+// which makes one of them slower shows up as such: parsing a Blorb,
+// finding its APal images, decoding a PNG, applying a palette and encoding
+// the result, compressing a replacement and writing a Blorb, using a Blorb
+// from synthetic.h.
+// Results are written to standard output as JSON, for comparison across
+// commits and across backends (build with and without NO_LIBOXI).
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <QImage>
+#include <QtGlobal>
+
+#include "libbpal.h"
+#include "synthetic.h"
+
+struct Result {
+    std::string name;
+    std::size_t iterations;
+    double best;
+    double median;
+};
+
+// Return the best and median time in nanoseconds per call of “f”, over
+// “repeats” runs of “iterations” calls.
+template <typename F>
+static Result measure(std::string name, int repeats, std::size_t iterations, F &&f)
+{
+    using clock = std::chrono::steady_clock;
+    std::vector<double> times;
+
+    for (int r = 0; r < repeats; r++) {
+        auto start = clock::now();
+        for (std::size_t i = 0; i < iterations; i++) {
+            f();
+        }
+        times.push_back(std::chrono::duration<double, std::nano>(clock::now() - start).count() / iterations);
+    }
+
+    std::ranges::sort(times);
+
+    return {std::move(name), iterations, times.front(), times[times.size() / 2]};
+}
+
+int main(int argc, char **argv)
+{
+    int repeats = argc > 1 ? std::atoi(argv[1]) : 10;
+    std::vector<Result> results;
+
+    synthetic::Options synthetic_options;
+    auto palettes = synthetic_options.palettes;
+    auto apal = synthetic_options.apal;
+    auto blorb = synthetic::blorb(synthetic_options);
+
+    // For writing, every pair gets a BPal entry; replacements are left
+    // out, and the entries point back at the APal images.
+    auto blorb_data = bpal::parse(blorb);
+    for (std::uint32_t p = 1; p <= palettes; p++) {
+        for (std::uint32_t a = palettes + 1; a <= palettes + apal; a++) {
+            blorb_data.bpal.emplace_back(p, a, a);
+        }
+    }
+
+    const auto &palette_png = blorb_data.picts.at(1).data;
+    const auto &apal_png = blorb_data.picts.at(palettes + 1).data;
+
+    results.push_back(measure("parse", repeats, 100, [&] {
+        auto parsed = bpal::parse(blorb);
+        if (parsed.picts.size() != palettes + apal) {
+            std::abort();
+        }
+    }));
+
+    results.push_back(measure("find_apal_images", repeats, 10000, [&] {
+        if (bpal::find_apal_images(blorb_data.chunks).size() != apal) {
+            std::abort();
+        }
+    }));
+
+    results.push_back(measure("decode", repeats, 100, [&] {
+        QImage image;
+        if (!image.loadFromData(apal_png.data(), apal_png.size(), "PNG")) {
+            std::abort();
+        }
+    }));
+
+    // Applying the palette and encoding the result, without decoding,
+    // which is measured above.
+    auto pair = bpal::decode_pair(apal_png, palette_png);
+    results.push_back(measure("convert", repeats, 50, [&] {
+        bpal::replace(*pair, bpal::ImageFormat::png);
+    }));
+
+    // Each compression runs with a fresh cache, on one thread.
+    auto converted = bpal::replace(apal_png, palette_png, bpal::ImageFormat::png).data;
+    bpal::Options options;
+    options.threads = 1;
+    bpal::Context context(std::move(options));
+    results.push_back(measure("compress", std::max(1, repeats / 5), 1, [&] {
+        bpal::Conversion conversion;
+        conversion.ids = {1000};
+        conversion.images = {converted};
+        conversion.digests = {bpal::digest(converted)};
+
+        bpal::BlorbData out;
+        context.clear_caches();
+        bpal::compress(out, conversion, context);
+    }));
+
+    results.push_back(measure("serialize", repeats, 100, [&] {
+        if (bpal::serialize(blorb_data).empty()) {
+            std::abort();
+        }
+    }));
+
+#ifdef LIBOXI
+    const char *backend = "liboxi";
+#else
+    const char *backend = "oxipng";
+#endif
+
+    std::cout << std::format("{{\n  \"qt\": \"{}\",\n  \"backend\": \"{}\",\n  \"blorb_bytes\": {},\n  \"results\": [\n",
+            qVersion(), backend, blorb.size());
+    for (std::size_t i = 0; i < results.size(); i++) {
+        const auto &result = results[i];
+        std::cout << std::format("    {{\"name\": \"{}\", \"iterations\": {}, \"best_ns\": {:.1f}, \"median_ns\": {:.1f}}}{}\n",
+                result.name, result.iterations, result.best, result.median, i + 1 < results.size() ? "," : "");
+    }
+    std::cout << "  ]\n}\n";
+
+    return 0;
+}
@@ -0,0 +1,239 @@
+// Compares the node-based containers which bpal used for its resource
+// tables (std::map and std::set) against the flat ones in flat_map.h.
+// Synthetic Blorbs with tens of thousands of resources are generated in
+// memory, and the table work done by bpal is replayed against them:
+// indexing RIdx offsets, attaching chunks to picture IDs, APal
+// membership checks for every (palette, APal) pair, appending
+// replacements, and walking pictures in ID order for output.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "flat_map.h"
+#include "libbpal.h"
+#include "synthetic.h"
+
+struct PictRef {
+    std::uint32_t type;
+    std::span<const unsigned char> data;
+};
+
+struct BPalEntry {
+    std::uint32_t palette;
+    std::uint32_t requested;
+    std::uint32_t id;
+};
+
+struct NodeTables {
+    static constexpr const char *name = "node";
+    using Offsets = std::map<std::uint32_t, std::uint32_t>;
+    using Picts = std::map<std::uint32_t, PictRef>;
+    using APal = std::set<std::uint32_t>;
+
+    static Offsets index(std::vector<std::pair<std::uint32_t, std::uint32_t>> entries) {
+        Offsets ids;
+        for (const auto &[offset, number] : entries) {
+            if (!ids.emplace(offset, number).second) {
+                std::abort();
+            }
+        }
+
+        return ids;
+    }
+};
+
+struct FlatTables {
+    static constexpr const char *name = "flat";
+    using Offsets = FlatMap<std::uint32_t, std::uint32_t>;
+    using Picts = FlatMap<std::uint32_t, PictRef>;
+    using APal = FlatSet<std::uint32_t>;
+
+    static Offsets index(std::vector<std::pair<std::uint32_t, std::uint32_t>> entries) {
+        std::ranges::stable_sort(entries, {}, &decltype(entries)::value_type::first);
+        if (std::ranges::adjacent_find(entries, {}, &decltype(entries)::value_type::first) != entries.end()) {
+            std::abort();
+        }
+
+        return Offsets(sorted_unique, std::move(entries));
+    }
+};
+
+using bpal::TypeID;
+
+static std::uint32_t read32(std::span<const unsigned char> data, std::size_t offset)
+{
+    return (data[offset] << 24) | (data[offset + 1] << 16) | (data[offset + 2] << 8) | data[offset + 3];
+}
+
+// A Blorb with “count” pictures, “apal” of which are listed in the APal
+// chunk. Images are tiny: only the tables are of interest here.
+static std::vector<unsigned char> synthetic_blorb(std::uint32_t count, std::uint32_t apal)
+{
+    synthetic::Options options;
+    options.palettes = count - apal;
+    options.apal = apal;
+    options.width = 8;
+    options.height = 8;
+    options.colors = 4;
+
+    return synthetic::blorb(options);
+}
+
+// Put the RIdx entries of “blorb” out of offset order.
+static void shuffle_ridx(std::vector<unsigned char> &blorb)
+{
+    auto count = read32(blorb, 20);
+    std::vector<std::array<unsigned char, 12>> entries(count);
+    for (std::uint32_t i = 0; i < count; i++) {
+        std::copy_n(blorb.begin() + 24 + (i * 12), 12, entries[i].begin());
+    }
+
+    std::ranges::shuffle(entries, std::mt19937(count));
+    for (std::uint32_t i = 0; i < count; i++) {
+        std::ranges::copy(entries[i], blorb.begin() + 24 + (i * 12));
+    }
+}
+
+struct Timings {
+    double parse = 0;
+    double convert = 0;
+    double write = 0;
+
+    double total() const { return parse + convert + write; }
+};
+
+template <typename Tables>
+static Timings run(std::span<const unsigned char> blorb, std::size_t &checksum)
+{
+    using clock = std::chrono::steady_clock;
+    auto ms = [](clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+
+    Timings timings;
+    auto start = clock::now();
+
+    typename Tables::Picts picts;
+    typename Tables::APal apal;
+
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> offsets;
+    std::uint32_t num = read32(blorb, 20);
+    std::uint32_t converted_id = 1000;
+    for (std::uint32_t i = 0; i < num; i++) {
+        auto number = read32(blorb, 24 + (i * 12) + 4);
+        auto offset = read32(blorb, 24 + (i * 12) + 8);
+        converted_id = std::max(converted_id, number + 1);
+        offsets.emplace_back(offset, number);
+    }
+
+    auto ids = Tables::index(std::move(offsets));
+
+    for (std::size_t pos = 24 + (num * 12); pos < blorb.size(); ) {
+        auto type = read32(blorb, pos);
+        auto size = read32(blorb, pos + 4);
+        auto data = blorb.subspan(pos + 8, size);
+
+        if (type == TypeID("APal")) {
+            for (std::size_t i = 0; i < size; i += 4) {
+                apal.insert(read32(data, i));
+            }
+        } else {
+            picts.emplace(ids.at(pos), PictRef{type, data});
+        }
+
+        pos += 8 + size + (size % 2);
+    }
+
+    timings.parse = ms(clock::now() - start);
+    start = clock::now();
+
+    // Model bpal’s conversion loop, but with replacement images which
+    // collide every so often, as happens with real palette sets.
+    std::vector<BPalEntry> bpal;
+    std::vector<std::uint32_t> replacements;
+    for (const auto &[id, pict] : picts) {
+        if (!apal.contains(id)) {
+            for (const auto apal_id : apal) {
+                if (!picts.contains(apal_id)) {
+                    std::abort();
+                }
+                if ((id + apal_id) % 4 != 0) {
+                    replacements.push_back(apal_id);
+                }
+                bpal.emplace_back(id, apal_id, converted_id + static_cast<std::uint32_t>(replacements.size()));
+            }
+        }
+    }
+
+    for (const auto source : replacements) {
+        picts.emplace(converted_id++, picts.at(source));
+    }
+
+    timings.convert = ms(clock::now() - start);
+    start = clock::now();
+
+    for (const auto &[id, pict] : picts) {
+        checksum += id + pict.data.size();
+    }
+    checksum += bpal.size();
+
+    timings.write = ms(clock::now() - start);
+
+    return timings;
+}
+
+template <typename Tables>
+static Timings best_of(int repeats, std::span<const unsigned char> blorb, std::size_t &checksum)
+{
+    Timings best;
+    for (int i = 0; i < repeats; i++) {
+        auto timings = run<Tables>(blorb, checksum);
+        if (i == 0 || timings.total() < best.total()) {
+            best = timings;
+        }
+    }
+
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    int repeats = argc > 1 ? std::atoi(argv[1]) : 5;
+    std::size_t checksum = 0;
+
+    std::cout << std::format("{:>8} {:>5} {:>8} {:>6} {:>10} {:>10} {:>10} {:>10}\n",
+            "picts", "apal", "ridx", "table", "parse ms", "convert ms", "write ms", "total ms");
+
+    for (auto count : {1000u, 10000u, 25000u, 50000u}) {
+        auto napal = (count + 4095) / 4096;
+        auto blorb = synthetic_blorb(count, napal);
+
+        for (auto shuffle : {false, true}) {
+            if (shuffle) {
+                shuffle_ridx(blorb);
+            }
+
+            auto report = [&](const char *name, const Timings &t) {
+                std::cout << std::format("{:>8} {:>5} {:>8} {:>6} {:>10.3f} {:>10.3f} {:>10.3f} {:>10.3f}\n",
+                        count, napal, shuffle ? "shuffled" : "ordered", name, t.parse, t.convert, t.write, t.total());
+            };
+
+            report(NodeTables::name, best_of<NodeTables>(repeats, blorb, checksum));
+            report(FlatTables::name, best_of<FlatTables>(repeats, blorb, checksum));
+        }
+    }
+
+    std::cerr << std::format("checksum: {}\n", checksum);
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+// Writes a synthetic Blorb file (see synthetic.h), and optionally a story
+// file drawing its pictures, for testing and benchmarking bpal without
+// the commercial games’ Blorbs.
+
+#include <cstdlib>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <span>
+#include <string>
+
+#include <getopt.h>
+
+#include "synthetic.h"
+
+static void write_file(const std::string &filename, std::span<const unsigned char> data)
+{
+    std::ofstream file(filename, std::ios::binary);
+    file.exceptions(std::ofstream::badbit | std::ofstream::failbit | std::ofstream::eofbit);
+
+    file.write(reinterpret_cast<const char *>(data.data()), data.size());
+}
+
+[[noreturn]]
+static void usage()
+{
+    std::cerr << "usage: mkblorb [options] out.blb [story.z6]\n"
+                 "\n"
+                 "options:\n"
+                 "  -p count                   current palette images (20)\n"
+                 "  -a count                   APal images (40)\n"
+                 "  -s widthxheight            size of APal images (320x200)\n"
+                 "  -c colors                  colors in each palette (256)\n"
+                 "  -v fraction                fraction of palettes with colors of their own (1)\n"
+                 "  -e bytes                   minimum size of the story file\n"
+                 "  -r seed                    random seed (1)\n";
+    std::exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    synthetic::Options options;
+    int c;
+
+    auto number = [](const char *arg) {
+        char *end;
+        auto n = std::strtoul(arg, &end, 10);
+        if (end == arg || *end != '\0') {
+            usage();
+        }
+        return n;
+    };
+
+    while ((c = getopt(argc, argv, "p:a:s:c:v:e:r:")) != -1) {
+        switch (c) {
+        case 'p':
+            options.palettes = number(optarg);
+            break;
+        case 'a':
+            options.apal = number(optarg);
+            break;
+        default:
+            if (!synthetic::parse_option(c, optarg, options)) {
+                usage();
+            }
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1 && argc != 2) {
+        usage();
+    }
+
+    if (options.palettes == 0 || options.apal == 0) {
+        usage();
+    }
+
+    try {
+        write_file(argv[0], synthetic::blorb(options));
+        if (argc == 2) {
+            write_file(argv[1], synthetic::story(options));
+        }
+    } catch (const std::ios_base::failure &e) {
+        std::cerr << std::format("error writing: {}\n", e.code().message());
+        return 1;
+    }
+
+    return 0;
+}
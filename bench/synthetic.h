@@ -0,0 +1,243 @@
+#ifndef BPAL_SYNTHETIC_H
+#define BPAL_SYNTHETIC_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include <QBuffer>
+#include <QByteArray>
+#include <QIODevice>
+#include <QImage>
+
+#include "libbpal.h"
+
+// Synthetic Blorb files shaped like those of Arthur and Zork Zero, for
+// benchmarks: current palette images, APal images drawn with indexed
+// colors, and optionally a story file which draws them.
+namespace synthetic {
+
+struct Options {
+    std::uint32_t palettes = 20;
+    std::uint32_t apal = 40;
+
+    // Of the APal images; current palette images are 8×8, as only their
+    // colors matter.
+    int width = 320;
+    int height = 200;
+
+    // Colors in every image’s palette.
+    int colors = 256;
+
+    // The fraction of current palette images with colors of their own;
+    // the rest repeat one of those, as in games which reuse a palette
+    // across scenes.
+    double variety = 1.0;
+
+    // If not zero, story() writes a version 6 story file of at least
+    // this many bytes, which draws every picture.
+    std::size_t exec_size = 0;
+
+    // If set, blorb() also gives every (palette, APal) pair a replacement
+    // and lists them in a BPal chunk. See replacement().
+    bool replacements = false;
+
+    std::uint32_t seed = 1;
+};
+
+// Set the field of “options” for a command-line option shared by the
+// tools using the generator: -s widthxheight, -c colors, -v variety,
+// -e exec_size or -r seed. Returns false if “c” is not one of them, or
+// “arg” is not valid for it.
+inline bool parse_option(int c, const char *arg, Options &options)
+{
+    char *end;
+
+    switch (c) {
+    case 's': {
+        options.width = std::strtoul(arg, &end, 10);
+        if (end == arg || *end != 'x') {
+            return false;
+        }
+        auto height = end + 1;
+        options.height = std::strtoul(height, &end, 10);
+        return end != height && *end == '\0' && options.width > 0 && options.height > 0;
+    }
+    case 'c':
+        options.colors = std::strtoul(arg, &end, 10);
+        return end != arg && *end == '\0' && options.colors >= 3 && options.colors <= 256;
+    case 'v':
+        options.variety = std::strtod(arg, &end);
+        return *end == '\0' && options.variety > 0 && options.variety <= 1;
+    case 'e':
+        options.exec_size = std::strtoul(arg, &end, 10);
+        return end != arg && *end == '\0';
+    case 'r':
+        options.seed = std::strtoul(arg, &end, 10);
+        return end != arg && *end == '\0';
+    default:
+        return false;
+    }
+}
+
+inline void write32(std::vector<unsigned char> &out, std::uint32_t n)
+{
+    out.insert(out.end(), {static_cast<unsigned char>(n >> 24), static_cast<unsigned char>(n >> 16),
+                           static_cast<unsigned char>(n >> 8), static_cast<unsigned char>(n)});
+}
+
+// An indexed image using the colors of “table”, with runs of a few
+// pixels, roughly as in drawn artwork, as a PNG file.
+inline std::vector<unsigned char> png(int width, int height, const QList<QRgb> &table, std::mt19937 &rng)
+{
+    QImage image(width, height, QImage::Format_Indexed8);
+    image.setColorTable(table);
+
+    for (int y = 0; y < height; y++) {
+        auto *line = image.scanLine(y);
+        for (int x = 0; x < width; ) {
+            auto run = 1 + static_cast<int>(rng() % 8);
+            auto index = static_cast<uchar>(rng() % table.size());
+            for (int j = 0; j < run && x < width; j++, x++) {
+                line[x] = index;
+            }
+        }
+    }
+
+    QByteArray data;
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::WriteOnly);
+    image.save(&buffer, "PNG", 100);
+
+    return {data.begin(), data.end()};
+}
+
+// The number of the replacement blorb() writes for (“palette”,
+// “apal_id”) if Options::replacements is set: replacements follow the
+// APal images, in palette order.
+inline std::uint32_t replacement(const Options &options, std::uint32_t palette, std::uint32_t apal_id)
+{
+    return options.palettes + options.apal + ((palette - 1) * options.apal) + (apal_id - options.palettes);
+}
+
+// Pictures 1 to “palettes” are the current palette images, and the next
+// “apal” are the APal images. Replacements, if any, share the chunk of
+// the APal image they replace, as only the tables matter to their users.
+inline std::vector<unsigned char> blorb(const Options &options)
+{
+    std::mt19937 rng(options.seed);
+
+    auto random_table = [&] {
+        QList<QRgb> table(options.colors);
+        for (auto &color : table) {
+            color = 0xff000000 | (rng() & 0xffffff);
+        }
+        return table;
+    };
+
+    auto distinct = std::max<std::uint32_t>(1, static_cast<std::uint32_t>(options.palettes * options.variety));
+    std::vector<QList<QRgb>> tables;
+    for (std::uint32_t i = 0; i < distinct; i++) {
+        tables.push_back(random_table());
+    }
+
+    std::vector<std::vector<unsigned char>> pngs;
+    for (std::uint32_t i = 0; i < options.palettes; i++) {
+        pngs.push_back(png(8, 8, tables[i % distinct], rng));
+    }
+    for (std::uint32_t i = 0; i < options.apal; i++) {
+        pngs.push_back(png(options.width, options.height, random_table(), rng));
+    }
+
+    std::vector<unsigned char> out;
+    auto count = static_cast<std::uint32_t>(pngs.size());
+    auto bpal_entries = options.replacements ? options.palettes * options.apal : 0;
+    auto indexed = count + bpal_entries;
+    std::size_t offset = 12 + 8 + 4 + (indexed * 12) + 8 + (options.apal * 4);
+    if (bpal_entries != 0) {
+        offset += 8 + (bpal_entries * 12);
+    }
+
+    std::vector<std::size_t> offsets;
+
+    write32(out, bpal::TypeID("FORM"));
+    write32(out, 0);
+    write32(out, bpal::TypeID("IFRS"));
+    write32(out, bpal::TypeID("RIdx"));
+    write32(out, 4 + (indexed * 12));
+    write32(out, indexed);
+    for (std::uint32_t id = 1; id <= count; id++) {
+        const auto &data = pngs[id - 1];
+        write32(out, bpal::TypeID("Pict"));
+        write32(out, id);
+        write32(out, offset);
+        offsets.push_back(offset);
+        offset += 8 + data.size() + (data.size() & 1);
+    }
+    for (std::uint32_t id = count + 1; id <= indexed; id++) {
+        write32(out, bpal::TypeID("Pict"));
+        write32(out, id);
+        write32(out, offsets[options.palettes + ((id - count - 1) % options.apal)]);
+    }
+
+    write32(out, bpal::TypeID("APal"));
+    write32(out, options.apal * 4);
+    for (std::uint32_t id = options.palettes + 1; id <= count; id++) {
+        write32(out, id);
+    }
+
+    if (bpal_entries != 0) {
+        write32(out, bpal::TypeID("BPal"));
+        write32(out, bpal_entries * 12);
+        for (std::uint32_t palette = 1; palette <= options.palettes; palette++) {
+            for (std::uint32_t apal_id = options.palettes + 1; apal_id <= count; apal_id++) {
+                write32(out, palette);
+                write32(out, apal_id);
+                write32(out, replacement(options, palette, apal_id));
+            }
+        }
+    }
+
+    for (const auto &data : pngs) {
+        write32(out, bpal::TypeID("PNG "));
+        write32(out, data.size());
+        out.insert(out.end(), data.begin(), data.end());
+        if (data.size() & 1) {
+            out.push_back(0);
+        }
+    }
+
+    auto size = out.size() - 8;
+    for (int i = 0; i < 4; i++) {
+        out[4 + i] = (size >> (24 - (i * 8))) & 0xff;
+    }
+
+    return out;
+}
+
+// A version 6 story file which is no real program: a header, padding,
+// and a draw_picture instruction (EXT:5 with one large constant) for
+// each picture, which is enough for drawable_pictures().
+inline std::vector<unsigned char> story(const Options &options)
+{
+    constexpr std::size_t high_memory = 64;
+
+    std::vector<unsigned char> out(high_memory);
+    out[0] = 6;
+    out[4] = high_memory >> 8;
+    out[5] = high_memory & 0xff;
+
+    for (std::uint32_t id = 1; id <= options.palettes + options.apal; id++) {
+        out.insert(out.end(), {0xbe, 0x05, 0x3f, static_cast<unsigned char>(id >> 8), static_cast<unsigned char>(id & 0xff)});
+    }
+
+    out.resize(std::max(out.size(), options.exec_size), 0xb4);
+
+    return out;
+}
+
+}
+
+#endif
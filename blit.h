@@ -0,0 +1,207 @@
+#ifndef BPAL_BLIT_H
+#define BPAL_BLIT_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BPAL_BLIT_X86 1
+#include <immintrin.h>
+#endif
+
+// Reference palette blitter, for interpreters which would rather apply
+// the Current Palette to an APal image at plot time than use pre-built
+// replacements. The interpreter decodes the APal image to 8-bit indices
+// once, and each plot then expands the indices into 32-bit pixels using
+// the merged palette, using compiler intrinsics on x86 where the CPU
+// supports them.
+namespace blit {
+
+// Colors are 0xAARRGGBB in native byte order, as in QRgb.
+using Palette = std::array<std::uint32_t, 256>;
+
+// The palette an APal image is drawn with: its own colors at indices 0
+// and 1, and the current palette image’s colors from index 2 up to the
+// end of the shorter of the two palettes, as with pre-built replacements.
+// Entries past the end of the APal image’s palette are zero.
+inline Palette merge(std::span<const std::uint32_t> apal, std::span<const std::uint32_t> current)
+{
+    Palette palette{};
+    auto size = std::min<std::size_t>(apal.size(), palette.size());
+
+    std::copy_n(apal.begin(), size, palette.begin());
+    for (std::size_t i = 2; i < std::min(size, current.size()); i++) {
+        palette[i] = current[i];
+    }
+
+    return palette;
+}
+
+enum class Kernel {
+    scalar,
+
+    // One 16-index shuffle per byte of the color, for palettes of up to
+    // 16 colors (4-bit images); blocks holding a larger index are done
+    // by the scalar kernel.
+    ssse3,
+
+    // Eight-way gathers from the full palette.
+    avx2,
+};
+
+namespace detail {
+
+inline void blit_scalar(const std::uint8_t *indices, std::size_t count, const Palette &palette, std::uint32_t *out)
+{
+    std::size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        out[i + 0] = palette[indices[i + 0]];
+        out[i + 1] = palette[indices[i + 1]];
+        out[i + 2] = palette[indices[i + 2]];
+        out[i + 3] = palette[indices[i + 3]];
+    }
+
+    for (; i < count; i++) {
+        out[i] = palette[indices[i]];
+    }
+}
+
+#ifdef BPAL_BLIT_X86
+__attribute__((target("ssse3")))
+inline void blit_ssse3(const std::uint8_t *indices, std::size_t count, const Palette &palette, std::uint32_t *out)
+{
+    // Split the first 16 colors into four byte planes, so that one
+    // shuffle looks up one byte of 16 pixels.
+    alignas(16) std::uint8_t planes[4][16];
+    for (int i = 0; i < 16; i++) {
+        for (int b = 0; b < 4; b++) {
+            planes[b][i] = palette[i] >> (b * 8);
+        }
+    }
+
+    auto b0 = _mm_load_si128(reinterpret_cast<const __m128i *>(planes[0]));
+    auto b1 = _mm_load_si128(reinterpret_cast<const __m128i *>(planes[1]));
+    auto b2 = _mm_load_si128(reinterpret_cast<const __m128i *>(planes[2]));
+    auto b3 = _mm_load_si128(reinterpret_cast<const __m128i *>(planes[3]));
+    auto high = _mm_set1_epi8(static_cast<char>(0xf0));
+    auto zero = _mm_setzero_si128();
+
+    std::size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        auto idx = _mm_loadu_si128(reinterpret_cast<const __m128i *>(indices + i));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(idx, high), zero)) != 0xffff) {
+            for (std::size_t j = i; j < i + 16; j++) {
+                out[j] = palette[indices[j]];
+            }
+            continue;
+        }
+
+        auto p0 = _mm_shuffle_epi8(b0, idx);
+        auto p1 = _mm_shuffle_epi8(b1, idx);
+        auto p2 = _mm_shuffle_epi8(b2, idx);
+        auto p3 = _mm_shuffle_epi8(b3, idx);
+
+        // Interleave the planes back into little-endian 32-bit pixels.
+        auto lo01 = _mm_unpacklo_epi8(p0, p1);
+        auto hi01 = _mm_unpackhi_epi8(p0, p1);
+        auto lo23 = _mm_unpacklo_epi8(p2, p3);
+        auto hi23 = _mm_unpackhi_epi8(p2, p3);
+
+        auto dst = reinterpret_cast<__m128i *>(out + i);
+        _mm_storeu_si128(dst + 0, _mm_unpacklo_epi16(lo01, lo23));
+        _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(lo01, lo23));
+        _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(hi01, hi23));
+        _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(hi01, hi23));
+    }
+
+    blit_scalar(indices + i, count - i, palette, out + i);
+}
+
+__attribute__((target("avx2")))
+inline void blit_avx2(const std::uint8_t *indices, std::size_t count, const Palette &palette, std::uint32_t *out)
+{
+    auto base = reinterpret_cast<const int *>(palette.data());
+
+    std::size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        auto idx = _mm_loadu_si128(reinterpret_cast<const __m128i *>(indices + i));
+        auto lo = _mm256_cvtepu8_epi32(idx);
+        auto hi = _mm256_cvtepu8_epi32(_mm_srli_si128(idx, 8));
+
+        auto dst = reinterpret_cast<__m256i *>(out + i);
+        _mm256_storeu_si256(dst + 0, _mm256_i32gather_epi32(base, lo, 4));
+        _mm256_storeu_si256(dst + 1, _mm256_i32gather_epi32(base, hi, 4));
+    }
+
+    blit_scalar(indices + i, count - i, palette, out + i);
+}
+#endif
+
+}
+
+// Whether “kernel” can run on this machine.
+inline bool supported(Kernel kernel)
+{
+    switch (kernel) {
+    case Kernel::scalar:
+        return true;
+#ifdef BPAL_BLIT_X86
+    case Kernel::ssse3:
+        return __builtin_cpu_supports("ssse3");
+    case Kernel::avx2:
+        return __builtin_cpu_supports("avx2");
+#else
+    default:
+        return false;
+#endif
+    }
+
+    return false;
+}
+
+// The fastest supported kernel for an image whose palette has “colors”
+// entries.
+inline Kernel best_kernel(std::size_t colors)
+{
+    if (colors <= 16 && supported(Kernel::ssse3)) {
+        return Kernel::ssse3;
+    }
+
+    return supported(Kernel::avx2) ? Kernel::avx2 : Kernel::scalar;
+}
+
+// Expand “indices” into “out”, which must be at least as long, using
+// “kernel” (which must be supported).
+inline void blit(std::span<const std::uint8_t> indices, const Palette &palette, std::span<std::uint32_t> out, Kernel kernel)
+{
+    switch (kernel) {
+#ifdef BPAL_BLIT_X86
+    case Kernel::ssse3:
+        detail::blit_ssse3(indices.data(), indices.size(), palette, out.data());
+        return;
+    case Kernel::avx2:
+        detail::blit_avx2(indices.data(), indices.size(), palette, out.data());
+        return;
+#endif
+    default:
+        detail::blit_scalar(indices.data(), indices.size(), palette, out.data());
+        return;
+    }
+}
+
+// As above, choosing the kernel from the number of colors in the APal
+// image’s palette. Interpreters plotting many images should call
+// best_kernel() once and cache the result.
+inline void blit(std::span<const std::uint8_t> indices, const Palette &palette, std::span<std::uint32_t> out, std::size_t colors = 256)
+{
+    blit(indices, palette, out, best_kernel(colors));
+}
+
+}
+
+#endif
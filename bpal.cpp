@@ -1,422 +1,742 @@
-#include <algorithm>
-#include <cctype>
-#include <cstdint>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <format>
 #include <fstream>
+#include <functional>
 #include <iostream>
-#include <map>
+#include <iterator>
 #include <memory>
 #include <optional>
-#include <ranges>
-#include <set>
 #include <span>
-#include <stdexcept>
+#include <sstream>
 #include <string>
-#include <utility>
+#include <string_view>
+#include <thread>
 #include <vector>
 
-#include <QBuffer>
-#include <QByteArray>
-#include <QIODevice>
-#include <QImage>
-#include <QtGlobal>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
-#ifdef LIBOXI
-#include "oxi.h"
-#else
-#include <boost/process.hpp>
-
-namespace bp = boost::process;
+#ifdef BPAL_ALLOC_STATS
+#include <atomic>
+#include <new>
 #endif
 
-class Error : public std::runtime_error {
-    using std::runtime_error::runtime_error;
-};
+#include "libbpal.h"
 
-struct Chunk {
-    std::uint32_t type;
-    std::vector<unsigned char> data;
-};
+#ifdef BPAL_ALLOC_STATS
+// Count allocations made through operator new, to measure the effect of
+// changes to memory handling. Buffers which Qt and oxipng allocate
+// internally via malloc are not included.
+static std::atomic<std::size_t> allocation_count;
+static std::atomic<std::size_t> allocation_bytes;
 
-struct BPalEntry {
-    std::uint32_t palette;
-    std::uint32_t requested;
-    std::uint32_t id;
-};
+void *operator new(std::size_t size)
+{
+    allocation_count++;
+    allocation_bytes += size;
 
-struct BlorbData {
-    std::vector<Chunk> chunks;
-    std::optional<std::vector<unsigned char>> exec;
-    std::map<std::uint32_t, Chunk> picts;
-    std::vector<BPalEntry> bpal;
-};
+    if (void *p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
 
-static constexpr std::uint32_t be32(unsigned char a, unsigned char b, unsigned char c, unsigned char d)
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
 {
-    return (static_cast<std::uint32_t>(a) << 24) |
-           (static_cast<std::uint32_t>(b) << 16) |
-           (static_cast<std::uint32_t>(c) <<  8) |
-           (static_cast<std::uint32_t>(d) <<  0);
+    std::free(p);
 }
 
-static constexpr std::uint32_t TypeID(const char (&id)[5])
+void operator delete(void *p, std::size_t) noexcept
 {
-    return be32(id[0], id[1], id[2], id[3]);
+    std::free(p);
 }
+#endif
 
-static std::string idstr(std::uint32_t id)
+static std::vector<unsigned char> read_file(const std::string &filename)
 {
-    auto aschar = [](unsigned char c) -> char { return std::isprint(c) ? c : ' '; };
+    std::ifstream file(filename, std::ios::binary);
+    file.exceptions(std::ifstream::badbit | std::ifstream::failbit | std::ifstream::eofbit);
 
-    return {
-        aschar(id >> 24),
-        aschar((id >> 16) & 0xff),
-        aschar((id >>  8) & 0xff),
-        aschar(id & 0xff)
-    };
+    return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
 }
 
-static QImage qimage_from_data(const std::span<unsigned char> data)
+static void write_file(const std::string &filename, std::span<const unsigned char> data)
 {
-    QImage image;
-
-    if (!image.loadFromData(data.data(), data.size(), "PNG")) {
-        throw Error("unable to load PNG");
-    }
+    std::ofstream file(filename, std::ios::binary);
+    file.exceptions(std::ofstream::badbit | std::ofstream::failbit | std::ofstream::eofbit);
 
-    return image;
+    file.write(reinterpret_cast<const char *>(data.data()), data.size());
 }
 
-static std::vector<unsigned char> compress_png(const std::span<unsigned char> png)
+struct Job {
+    std::string blorb;
+    std::string out;
+    std::optional<std::string> story;
+};
+
+// A job line holds a Blorb file, the output file, and optionally a
+// story file to bundle. Blank lines and lines starting with # hold no
+// job.
+static std::optional<Job> parse_job(const std::string &line)
 {
-#ifdef LIBOXI
-    auto compressed = optimize_png(png.data(), png.size());
-    if (compressed.data == nullptr) {
-        throw Error("unable to compress image");
+    std::istringstream ss(line);
+    std::vector<std::string> fields{std::istream_iterator<std::string>(ss), std::istream_iterator<std::string>()};
+
+    if (fields.empty() || fields[0].starts_with("#")) {
+        return std::nullopt;
     }
 
-    auto freefn = [](unsigned char *p) { std::free(p); };
-    std::unique_ptr<unsigned char, decltype(freefn)> free_png(compressed.data, freefn);
+    if (fields.size() != 2 && fields.size() != 3) {
+        throw bpal::Error("expected “blorb output [story]”");
+    }
 
-    return {compressed.data, compressed.data + compressed.size};
-#else
-    bp::ipstream out;
-    bp::opstream in;
+    return Job{fields[0], fields[1], fields.size() == 3 ? std::optional(fields[2]) : std::nullopt};
+}
 
-    bp::child c("/usr/bin/oxipng", "-o6", "-q", "--stdout", "-", bp::std_in < in, bp::std_out > out);
+// A manifest has one job line per job.
+static std::vector<Job> read_manifest(const std::string &filename)
+{
+    std::ifstream file;
+    std::istream *in = &std::cin;
 
-    in.write(reinterpret_cast<const char *>(png.data()), png.size());
-    in.flush();
-    in.pipe().close();
+    if (filename != "-") {
+        file.open(filename);
+        if (!file.is_open()) {
+            throw bpal::Error(std::format("unable to open manifest {}", filename));
+        }
+        in = &file;
+    }
 
-    c.wait();
-    if (c.exit_code() != 0) {
-        throw Error(std::format("optipng exited {}", c.exit_code()));
+    std::vector<Job> jobs;
+    std::string line;
+    for (int lineno = 1; std::getline(*in, line); lineno++) {
+        try {
+            if (auto job = parse_job(line)) {
+                jobs.push_back(*job);
+            }
+        } catch (const bpal::Error &e) {
+            throw bpal::Error(std::format("{}:{}: {}", filename, lineno, e.what()));
+        }
     }
 
-    return {std::istreambuf_iterator<char>(out), std::istreambuf_iterator<char>()};
-#endif
+    return jobs;
 }
 
-static std::vector<unsigned char> convert_palette(QImage apal_image, const QImage &palette)
-{
-    if (palette.format() != QImage::Format_Indexed8) {
-        throw Error("palette source not indexed");
-    }
+// With incremental rebuilds, each output file gets a state file named
+// after it, and when both are present, replacements which are still up
+// to date are taken from the output file rather than made again.
+static bool incremental = false;
 
-    auto dst = apal_image.colorTable();
-    auto src = palette.colorTable();
+// Draw traces from -d; if any are given, only the pairs which they reach
+// are generated.
+static std::vector<bpal::DrawTrace> traces;
 
-    for (int i = 2; i < qMin(src.size(), dst.size()); i++) {
-        dst[i] = src[i];
-    }
+// With -p, pairs are pruned using an analysis of the story file, when
+// one is given.
+static bool prune = false;
 
-    apal_image.setColorTable(dst);
+// Palette clustering, from -c and -t.
+static std::optional<bpal::ClusterOptions> cluster;
 
-    QByteArray ba;
-    QBuffer buffer(&ba);
+// Which forms of replacement to write, from -r.
+static bpal::Replacements replacements = bpal::Replacements::images;
 
-    if (!buffer.open(QIODevice::WriteOnly)) {
-        throw Error("unable to open QBuffer");
-    }
+// How to write the BPal table, from -f.
+static bpal::TableFormat table_format = bpal::TableFormat::list;
 
-    if (!apal_image.save(&buffer, "PNG", 100)) {
-        throw Error("unable to store image as PNG");
-    }
+// How to order chunks in the output, from -l.
+static bpal::Layout layout = bpal::Layout::ids;
 
-    return {ba.begin(), ba.end()};
-}
+// Window sizes to pre-scale replacements for, from -w.
+static std::vector<bpal::WindowSize> windows;
 
-std::set<std::uint32_t> find_apal_images(const std::span<Chunk> chunks)
-{
-    auto apal = std::find_if(chunks.begin(), chunks.end(), [](const auto &chunk) {
-        return chunk.type == TypeID("APal");
-    });
+// With -n, jobs only report an estimate of their output.
+static bool plan_only = false;
 
-    if (apal == chunks.end()) {
-        throw Error("no APal chunk found");
-    }
+enum class ProgressMode {
+    none,
+    tty,
+    lines,
+};
 
-    if (apal->data.size() % 4 != 0) {
-        throw Error(std::format("invalid APal size: {}", apal->data.size()));
+// Reports compression progress on standard error, at most every
+// “interval”. On a terminal, one line is redrawn in place; in line mode,
+// for other programs to read, each report is a line such as
+//
+//     progress images=12 total=200 rate=3.40 saved=12345 eta=56.0
+//
+// The ETA assumes that the remaining images compress at the same rate
+// in bytes as those done so far, since larger images take longer.
+class ProgressReporter {
+public:
+    explicit ProgressReporter(ProgressMode mode) :
+        m_mode(mode),
+        m_interval(mode == ProgressMode::tty ? std::chrono::milliseconds(100) : std::chrono::milliseconds(1000))
+    {
     }
 
-    std::set<std::uint32_t> apal_images;
+    void update(const bpal::Progress &progress) {
+        auto now = std::chrono::steady_clock::now();
+
+        if (progress.images == 0) {
+            m_start = now;
+            m_last = now;
+            return;
+        }
 
-    for (std::size_t i = 0; i < apal->data.size(); i += 4) {
-        auto id = be32(apal->data[i + 0], apal->data[i + 1], apal->data[i + 2], apal->data[i + 3]);
+        bool done = progress.images == progress.total_images;
+        if (!done && now - m_last < m_interval) {
+            return;
+        }
+        m_last = now;
+
+        double elapsed = std::chrono::duration<double>(now - m_start).count();
+        double rate = elapsed > 0 ? progress.images / elapsed : 0;
+        double eta = 0;
+        if (progress.bytes > 0 && progress.total_bytes > 0) {
+            eta = elapsed * (progress.total_bytes - progress.bytes) / progress.bytes;
+        } else if (rate > 0) {
+            eta = (progress.total_images - progress.images) / rate;
+        }
 
-        apal_images.insert(id);
+        if (m_mode == ProgressMode::lines) {
+            std::cerr << std::format("progress images={} total={} rate={:.2f} saved={} eta={:.1f}\n",
+                    progress.images, progress.total_images, rate, progress.saved, eta) << std::flush;
+        } else {
+            auto seconds = static_cast<long>(std::lround(eta));
+            std::cerr << std::format("\r{}/{} images, {:.1f}/s, {:.1f} MB saved, ETA {}:{:02}\033[K{}",
+                    progress.images, progress.total_images, rate, progress.saved / 1e6, seconds / 60, seconds % 60, done ? "\n" : "") << std::flush;
+        }
     }
 
-    return apal_images;
+private:
+    ProgressMode m_mode;
+    std::chrono::steady_clock::duration m_interval;
+    std::chrono::steady_clock::time_point m_start;
+    std::chrono::steady_clock::time_point m_last;
+};
+
+static std::string state_filename(const std::string &out)
+{
+    return out + ".bpal-state";
 }
 
-static BlorbData load_blorb_data(const std::string &filename)
+// Returns an error message if the job failed.
+static std::optional<std::string> run_job(bpal::Context &context, const Job &job)
 {
-    BlorbData blorb_data;
+    std::optional<std::vector<unsigned char>> exec;
+    std::optional<std::vector<unsigned char>> previous;
+    bpal::JobOptions options;
+    options.traces = traces;
+    options.prune = prune;
+    options.cluster = cluster;
+    options.replacements = replacements;
+    options.table_format = table_format;
+    options.layout = layout;
+    options.windows = windows;
+
+    if (job.story.has_value()) {
+        try {
+            exec = read_file(*job.story);
+            options.exec = *exec;
+        } catch (const std::ios_base::failure &e) {
+            return std::format("error processing {}: {}", *job.story, e.code().message());
+        }
+    }
 
-    std::ifstream file(filename, std::ios::binary);
-    file.exceptions(std::ifstream::badbit | std::ifstream::failbit | std::ifstream::eofbit);
+    // A missing or unreadable state file just means a full rebuild.
+    if (incremental && !plan_only) {
+        try {
+            auto text = read_file(state_filename(job.out));
+            options.previous_state = bpal::parse_incremental_state(std::string_view(reinterpret_cast<const char *>(text.data()), text.size()));
+            previous = read_file(job.out);
+            options.previous = *previous;
+        } catch (const std::ios_base::failure &) {
+            options.previous_state.reset();
+        } catch (const bpal::Error &e) {
+            std::cerr << std::format("warning: {}: {}\n", state_filename(job.out), e.what());
+        }
+    }
 
-    auto read32 = [&file]() -> std::uint32_t {
-        unsigned char a = file.get();
-        unsigned char b = file.get();
-        unsigned char c = file.get();
-        unsigned char d = file.get();
+    try {
+        auto blorb = read_file(job.blorb);
+
+        if (plan_only) {
+            auto estimate = bpal::estimate(blorb, options, context);
+            std::cout << std::format("{}: {} pairs, {} replacements ({} sampled), {} bytes before compression\n",
+                    job.blorb, estimate.pairs, estimate.replacements, estimate.samples, estimate.uncompressed_bytes);
+            std::cout << std::format("{:>8} {:>12} {:>12} {:>10} {:>10}\n", "preset", "compressed", "output", "cpu s", "wall s");
+            for (const auto &preset : estimate.presets) {
+                std::cout << std::format("{:>8} {:>12} {:>12} {:>10.2f} {:>10.2f}\n",
+                        preset.level, preset.compressed_bytes, preset.output_bytes, preset.cpu_seconds, preset.wall_seconds);
+            }
+            return std::nullopt;
+        }
 
-        return be32(a, b, c, d);
-    };
+        auto out = bpal::process(blorb, options, context);
+        write_file(job.out, out.blorb);
 
-    if (read32() != TypeID("FORM")) {
-        throw Error("not a blorb");
+        if (incremental) {
+            auto text = bpal::format_incremental_state(out.state);
+            write_file(state_filename(job.out), std::span(reinterpret_cast<const unsigned char *>(text.data()), text.size()));
+        }
+    } catch (const bpal::Error &e) {
+        return std::format("error: {}: {}", job.blorb, e.what());
+    } catch (const std::ios_base::failure &e) {
+        return std::format("error processing {}: {}", job.blorb, e.code().message());
     }
 
-    auto size = read32();
+    return std::nullopt;
+}
 
-    if (read32() != TypeID("IFRS") || read32() != TypeID("RIdx")) {
-        throw Error("not a blorb");
+static void send(int fd, std::string_view reply)
+{
+    while (!reply.empty()) {
+        auto n = write(fd, reply.data(), reply.size());
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return;
+        }
+
+        reply.remove_prefix(n);
     }
+}
 
-    // Map offsets to IDs.
-    std::map<std::streamoff, std::uint32_t> ids;
-    auto n = read32();
-    auto num = read32();
-    if (n != ((num * 12) + 4)) {
-        throw Error("RIdx mismatch");
+// Each line a client sends is either a job line, or a command:
+//
+//     stats   report the number of entries in each cache
+//     clear   empty all caches
+//
+// and gets a one-line reply: “ok” followed by the time taken in
+// milliseconds (or, for “stats”, the cache sizes), or an error message,
+// which starts with “error”. Blank lines and comments get no reply.
+// Jobs from different clients run concurrently, sharing the Context.
+static void serve_client(bpal::Context &context, int fd)
+{
+    std::unique_ptr<FILE, decltype(&std::fclose)> fp(fdopen(fd, "r"), std::fclose);
+    if (fp == nullptr) {
+        close(fd);
+        return;
     }
 
-    // Converted IDs start at 1000, unless the Blorb file contains
-    // larger IDs, at which point the converted IDs start at the largest
-    // ID plus one.
-    std::uint32_t converted_id = 1000;
+    char *buf = nullptr;
+    std::size_t size = 0;
+    ssize_t n;
 
-    for (size_t i = 0; i < num; i++) {
-        auto usage = read32();
-        auto number = read32();
-        auto start = read32();
+    while ((n = getline(&buf, &size, fp.get())) != -1) {
+        std::string line(buf, n);
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+            line.pop_back();
+        }
 
-        if (usage != TypeID("Pict")) {
-            throw Error(std::format("unknown resource usage: {:08x} ({})", usage, idstr(usage)));
+        auto start = std::chrono::steady_clock::now();
+        auto elapsed = [&start] {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        };
+
+        if (line == "stats") {
+            auto stats = context.cache_stats();
+            send(fd, std::format("ok compressed={} replacements={} apal_images={} palettes={}\n",
+                        stats.compressed, stats.replacements, stats.apal_images, stats.palettes));
+            continue;
+        } else if (line == "clear") {
+            context.clear_caches();
+            send(fd, std::format("ok {:.1f}\n", elapsed()));
+            continue;
         }
 
-        converted_id = std::max(converted_id, number + 1);
+        try {
+            auto job = parse_job(line);
+            if (!job.has_value()) {
+                continue;
+            }
+
+            if (auto error = run_job(context, *job)) {
+                send(fd, *error + "\n");
+            } else {
+                send(fd, std::format("ok {:.1f}\n", elapsed()));
+            }
 
-        // This is legal but neither Arthur nor Zork Zero does it.
-        if (!ids.emplace(start, number).second) {
-            throw Error(std::format("duplicate offset {:x} for id {}", start, number));
+            std::cout << std::format("{} -> {}: {:.1f}ms\n", job->blorb, job->out, elapsed()) << std::flush;
+        } catch (const std::exception &e) {
+            // Anything a request can throw (std::bad_alloc on a hostile
+            // Blorb, say) is reported to its client, since escaping the
+            // thread would take down the server and all other clients.
+            send(fd, std::format("error: {}\n", e.what()));
+        } catch (...) {
+            send(fd, "error: unknown exception\n");
         }
     }
 
-    while (file.tellg() < size + 8) {
-        std::streamoff pos = file.tellg();
-        auto chunktype = read32();
+    std::free(buf);
+}
 
-        auto size = read32();
-        std::vector<unsigned char> chunk(size);
-        file.read(reinterpret_cast<char *>(chunk.data()), size);
-        if (size % 2 == 1) {
-            file.get();
-        }
+// The socket the server is listening on, removed by remove_socket().
+static char listening_path[sizeof(sockaddr_un::sun_path)];
 
-        switch (chunktype) {
-        case TypeID("IFhd"): case TypeID("SNam"): case TypeID("(c) "): case TypeID("AUTH"):
-        case TypeID("RelN"): case TypeID("Reso"): case TypeID("APal"):
-            blorb_data.chunks.emplace_back(chunktype, std::move(chunk));
-            break;
-        case TypeID("PNG "): case TypeID("Rect"): {
-            try {
-                auto id = ids.at(pos);
-                blorb_data.picts.emplace(id, Chunk{chunktype, std::move(chunk)});
-            } catch (const std::out_of_range &) {
-                throw Error(std::format("found {:08x} ({}) chunk at offset {:x}, but no RIdx entries reference it", chunktype, idstr(chunktype), pos));
-            }
-            break;
-        }
-        case TypeID("BPal"):
-            throw Error("this file already has a BPal chunk");
-        default:
-            throw Error(std::format("unknown chunk: {:08x} ({}) @{:x}", chunktype, idstr(chunktype), pos));
-        }
+// Remove the socket on SIGINT and SIGTERM, then die of the signal as
+// usual; unlink() and raise() are async-signal-safe.
+static void remove_socket(int signal)
+{
+    unlink(listening_path);
+    std::signal(signal, SIG_DFL);
+    std::raise(signal);
+}
+
+[[noreturn]]
+static void serve(bpal::Context &context, const std::string &path)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) {
+        throw bpal::Error(std::format("socket path too long: {}", path));
     }
+    path.copy(addr.sun_path, path.size());
 
-    std::map<std::uint32_t, QImage> apal_images;
-    for (const auto apal_id : find_apal_images(blorb_data.chunks)) {
-        try {
-            apal_images.insert({apal_id, qimage_from_data(blorb_data.picts.at(apal_id).data)});
-        } catch (const std::out_of_range &) {
-            throw Error(std::format("APal references image {}, which does not exist", apal_id));
-        }
+    // Remove a stale socket left behind by an earlier server, but never
+    // anything other than a socket.
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
     }
 
-    if (apal_images.empty()) {
-        throw Error("no APal images found");
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        throw bpal::Error(std::format("unable to create socket: {}", std::strerror(errno)));
     }
 
-    decltype(blorb_data.picts) converted_picts;
+    if (bind(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof addr) == -1 || listen(fd, 16) == -1) {
+        throw bpal::Error(std::format("unable to listen on {}: {}", path, std::strerror(errno)));
+    }
 
-    std::map<std::vector<unsigned char>, std::uint32_t> image_cache;
+    path.copy(listening_path, path.size());
+    std::signal(SIGINT, remove_socket);
+    std::signal(SIGTERM, remove_socket);
 
-    std::cout << "Converting images...\n";
-    for (auto &[id, chunk] : blorb_data.picts) {
-        if (chunk.type == TypeID("PNG ") && !apal_images.contains(id)) {
-            QImage palette_image = qimage_from_data(chunk.data);
-            for (const auto &[apal_id, apal_image] : apal_images) {
-                auto converted = convert_palette(apal_image, palette_image);
-                auto [it, inserted] = image_cache.try_emplace(converted, converted_id);
-                if (inserted) {
-                    converted_picts.emplace(converted_id++, Chunk{chunk.type, std::move(converted)});
-                }
+    // A client which goes away before reading its reply must not take
+    // the server down with it.
+    std::signal(SIGPIPE, SIG_IGN);
 
-                blorb_data.bpal.emplace_back(id, apal_id, it->second);
+    std::cout << std::format("listening on {}\n", path) << std::flush;
+
+    for (;;) {
+        int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
             }
-        }
-    }
 
-    std::cout << "Compressing images...\n";
-    for (auto &[_, chunk] : converted_picts) {
-        if (chunk.type == TypeID("PNG ")) {
-            chunk.data = compress_png(chunk.data);
+            unlink(listening_path);
+            throw bpal::Error(std::format("accept failed: {}", std::strerror(errno)));
         }
-    }
 
-    blorb_data.picts.merge(converted_picts);
+        std::thread(serve_client, std::ref(context), client).detach();
+    }
+}
 
-    return blorb_data;
+[[noreturn]]
+static void usage()
+{
+    std::cerr << "usage: bpal [options] [-o out.blb] blorb.blb [story.z6]\n"
+                 "       bpal [options] -m manifest\n"
+                 "       bpal [options] -s socket\n"
+                 "\n"
+                 "options:\n"
+                 "  -j threads                 number of threads to use\n"
+                 "  -C bytes                   limit the images cached between jobs to bytes\n"
+                 "  -i                         rebuild incrementally, using out.blb.bpal-state\n"
+                 "  -d trace                   only generate pairs reached by a draw trace\n"
+                 "  -p                         only generate pairs the story can draw\n"
+                 "  -c threshold               share replacements between similar palettes\n"
+                 "  -t size                    cluster palettes to fit the output in size bytes\n"
+                 "  -r images|palettes|both    forms of replacement to generate\n"
+                 "  -f list|matrix|both        formats of BPal table to write\n"
+                 "  -l ids|locality            order of chunks in the output\n"
+                 "  -w widthxheight            also write replacements scaled for this window\n"
+                 "  -S stats.json              write timings and sizes of all jobs as JSON\n"
+                 "  -T trace.json              write a Chrome trace of all jobs\n"
+                 "  -P tty|lines|none          how to report compression progress\n"
+                 "  -n                         estimate output size and time, writing nothing\n";
+    std::exit(1);
 }
 
-static void write_blorb(const std::string &filename, const BlorbData &blorb_data)
+int main(int argc, char **argv)
 {
-    std::ofstream file(filename, std::ios::binary);
-    file.exceptions(std::ofstream::badbit | std::ofstream::failbit | std::ofstream::eofbit);
+#ifdef BPAL_ALLOC_STATS
+    auto start = std::chrono::steady_clock::now();
+#endif
 
-    auto write32 = [&file](std::uint32_t n) {
-        file.put(n >> 24);
-        file.put((n >> 16) & 0xff);
-        file.put((n >>  8) & 0xff);
-        file.put(n & 0xff);
+    static const struct option longopts[] = {
+        {"threads", required_argument, nullptr, 'j'},
+        {"cache-limit", required_argument, nullptr, 'C'},
+        {"output", required_argument, nullptr, 'o'},
+        {"manifest", required_argument, nullptr, 'm'},
+        {"server", required_argument, nullptr, 's'},
+        {"incremental", no_argument, nullptr, 'i'},
+        {"draws", required_argument, nullptr, 'd'},
+        {"prune", no_argument, nullptr, 'p'},
+        {"cluster", required_argument, nullptr, 'c'},
+        {"target-size", required_argument, nullptr, 't'},
+        {"replacements", required_argument, nullptr, 'r'},
+        {"table", required_argument, nullptr, 'f'},
+        {"layout", required_argument, nullptr, 'l'},
+        {"window", required_argument, nullptr, 'w'},
+        {"stats", required_argument, nullptr, 'S'},
+        {"trace", required_argument, nullptr, 'T'},
+        {"progress", required_argument, nullptr, 'P'},
+        {"plan", no_argument, nullptr, 'n'},
+        {nullptr, 0, nullptr, 0},
     };
 
-    file << "FORM....IFRSRIdx";
-    std::uint32_t ridx_size = blorb_data.picts.size();
-    if (blorb_data.exec.has_value()) {
-        ridx_size++;
-    }
-    write32(4 + (ridx_size * 12));
-    write32(ridx_size);
-
-    for (const auto &[id, _] : blorb_data.picts) {
-        file << "Pict";
-        write32(id);
-        write32(0); // placeholder
+    bpal::Options options;
+    std::string out = "out.blb";
+    std::optional<std::string> manifest;
+    std::optional<std::string> socket_path;
+    std::optional<std::string> stats_path;
+    bpal::Statistics statistics;
+    std::optional<std::string> trace_path;
+    bpal::Trace trace;
+    std::optional<ProgressMode> progress_mode;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "ipnd:c:t:r:f:l:w:j:C:o:m:s:S:T:P:", longopts, nullptr)) != -1) {
+        switch (c) {
+        case 'r':
+            if (optarg == std::string_view("images")) {
+                replacements = bpal::Replacements::images;
+            } else if (optarg == std::string_view("palettes")) {
+                replacements = bpal::Replacements::palettes;
+            } else if (optarg == std::string_view("both")) {
+                replacements = bpal::Replacements::both;
+            } else {
+                usage();
+            }
+            break;
+        case 'f':
+            if (optarg == std::string_view("list")) {
+                table_format = bpal::TableFormat::list;
+            } else if (optarg == std::string_view("matrix")) {
+                table_format = bpal::TableFormat::matrix;
+            } else if (optarg == std::string_view("both")) {
+                table_format = bpal::TableFormat::both;
+            } else {
+                usage();
+            }
+            break;
+        case 'l':
+            if (optarg == std::string_view("ids")) {
+                layout = bpal::Layout::ids;
+            } else if (optarg == std::string_view("locality")) {
+                layout = bpal::Layout::locality;
+            } else {
+                usage();
+            }
+            break;
+        case 'P':
+            if (optarg == std::string_view("tty")) {
+                progress_mode = ProgressMode::tty;
+            } else if (optarg == std::string_view("lines")) {
+                progress_mode = ProgressMode::lines;
+            } else if (optarg == std::string_view("none")) {
+                progress_mode = ProgressMode::none;
+            } else {
+                usage();
+            }
+            break;
+        case 'j':
+            options.threads = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'C': {
+            char *end;
+            options.cache_limit = std::strtoull(optarg, &end, 10);
+            if (*end != '\0' || end == optarg || options.cache_limit == 0) {
+                usage();
+            }
+            break;
+        }
+        case 'o':
+            out = optarg;
+            break;
+        case 'm':
+            manifest = optarg;
+            break;
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'S':
+            stats_path = optarg;
+            options.statistics = &statistics;
+            break;
+        case 'T':
+            trace_path = optarg;
+            options.trace = &trace;
+            break;
+        case 'i':
+            incremental = true;
+            break;
+        case 'p':
+            prune = true;
+            break;
+        case 'n':
+            plan_only = true;
+            break;
+        case 'c': {
+            char *end;
+            auto threshold = std::strtod(optarg, &end);
+            if (*end != '\0' || !(threshold >= 0)) {
+                usage();
+            }
+            cluster = cluster.value_or(bpal::ClusterOptions{});
+            cluster->threshold = threshold;
+            break;
+        }
+        case 't': {
+            char *end;
+            auto size = std::strtoull(optarg, &end, 10);
+            if (*end != '\0' || end == optarg) {
+                usage();
+            }
+            cluster = cluster.value_or(bpal::ClusterOptions{});
+            cluster->target_size = size;
+            break;
+        }
+        case 'w': {
+            char *end;
+            auto width = std::strtoul(optarg, &end, 10);
+            if (end == optarg || *end != 'x') {
+                usage();
+            }
+            auto height_start = end + 1;
+            auto height = std::strtoul(height_start, &end, 10);
+            if (end == height_start || *end != '\0' || width == 0 || height == 0) {
+                usage();
+            }
+            windows.emplace_back(width, height);
+            break;
+        }
+        case 'd':
+            try {
+                auto text = read_file(optarg);
+                traces.push_back(bpal::parse_draw_trace(std::string_view(reinterpret_cast<const char *>(text.data()), text.size())));
+            } catch (const std::ios_base::failure &e) {
+                std::cerr << std::format("error reading {}: {}\n", optarg, e.code().message());
+                std::exit(1);
+            } catch (const bpal::Error &e) {
+                std::cerr << std::format("error: {}: {}\n", optarg, e.what());
+                std::exit(1);
+            }
+            break;
+        default:
+            usage();
+        }
     }
 
-    if (blorb_data.exec.has_value()) {
-        file << "Exec";
-        write32(0);
-        write32(0);
-    }
+    argc -= optind;
+    argv += optind;
 
-    auto write_chunk = [&file, &write32](const Chunk &chunk) {
-        write32(chunk.type);
-        write32(chunk.data.size());
-        file.write(reinterpret_cast<const char *>(chunk.data.data()), chunk.data.size());
-        if (chunk.data.size() % 2 == 1) {
-            file.put(0);
+    if (socket_path.has_value()) {
+        if (argc != 0 || manifest.has_value() || stats_path.has_value() || trace_path.has_value() || progress_mode.has_value() || plan_only) {
+            usage();
         }
-    };
 
-    for (const auto &chunk : blorb_data.chunks) {
-        write_chunk(chunk);
-    }
+        // A server Context lives as long as the server, so caches stay
+        // warm from one job to the next.
+        bpal::Context context(std::move(options));
 
-    std::vector<std::streamoff> offsets;
-    for (const auto &[_, chunk] : blorb_data.picts) {
-        offsets.push_back(file.tellp());
-        write_chunk(chunk);
+        try {
+            serve(context, *socket_path);
+        } catch (const bpal::Error &e) {
+            std::cerr << "error: " << e.what() << std::endl;
+            std::exit(1);
+        }
     }
 
-    if (blorb_data.exec.has_value()) {
-        offsets.push_back(file.tellp());
-        write_chunk(Chunk{TypeID("ZCOD"), *blorb_data.exec});
-    }
+    std::vector<Job> jobs;
 
-    if (blorb_data.bpal.empty()) {
-        throw Error("BPal chunk is empty");
-    }
+    if (manifest.has_value()) {
+        if (argc != 0) {
+            usage();
+        }
 
-    file.write("BPal", 4);
-    write32(blorb_data.bpal.size() * 4 * 3);
+        try {
+            jobs = read_manifest(*manifest);
+        } catch (const bpal::Error &e) {
+            std::cerr << "error: " << e.what() << std::endl;
+            std::exit(1);
+        }
+    } else {
+        if (argc != 1 && argc != 2) {
+            usage();
+        }
 
-    for (const auto &bpal_entry : blorb_data.bpal) {
-        write32(bpal_entry.palette);
-        write32(bpal_entry.requested);
-        write32(bpal_entry.id);
+        jobs.emplace_back(argv[0], out, argc == 2 ? std::optional<std::string>(argv[1]) : std::nullopt);
     }
 
-    for (const auto &[i, offset] : std::views::enumerate(offsets)) {
-        file.seekp(0x20 + (i * 12));
-        write32(offset);
+    // All jobs share one Context, and thus one worker pool and one set
+    // of caches: artwork which appears in several Blorbs is converted and
+    // compressed only once.
+    options.status = [&jobs](std::string_view message) {
+        if (jobs.size() == 1) {
+            std::cout << message << "\n";
+        }
+    };
+
+    // Progress is shown by default only on a terminal.
+    auto mode = progress_mode.value_or(isatty(STDERR_FILENO) ? ProgressMode::tty : ProgressMode::none);
+    ProgressReporter progress(mode);
+    if (mode != ProgressMode::none) {
+        options.progress = [&progress](const bpal::Progress &p) {
+            progress.update(p);
+        };
     }
 
-    file.seekp(0, std::ios::end);
-    std::streamoff size = file.tellp();
-    file.seekp(4);
-    write32(size - 8);
-}
+    bpal::Context context(std::move(options));
+    bool ok = true;
 
-int main(int argc, char **argv)
-{
-    if (argc != 2 && argc != 3) {
-        std::cerr << "usage: bpal blorb.blb [story.z6]\n";
-        std::exit(1);
+    for (const auto &job : jobs) {
+        if (jobs.size() > 1) {
+            std::cout << std::format("{} -> {}\n", job.blorb, job.out);
+        }
+
+        if (auto error = run_job(context, job)) {
+            std::cerr << *error << std::endl;
+            ok = false;
+        }
     }
 
-    std::optional<std::vector<unsigned char>> exec;
+    auto write_json = [&ok](const std::optional<std::string> &path, const std::string &json) {
+        if (!path.has_value()) {
+            return;
+        }
 
-    if (argc == 3) {
         try {
-            std::ifstream file(argv[2], std::ios::binary);
-            file.exceptions(std::ifstream::badbit | std::ifstream::failbit | std::ifstream::eofbit);
-            exec.emplace(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            write_file(*path, std::span(reinterpret_cast<const unsigned char *>(json.data()), json.size()));
         } catch (const std::ios_base::failure &e) {
-            std::cerr << std::format("error processing {}: {}\n", argv[2], e.code().message());
-            std::exit(1);
+            std::cerr << std::format("error writing {}: {}\n", *path, e.code().message());
+            ok = false;
         }
-    }
+    };
 
-    try {
-        auto blorb_data = load_blorb_data(argv[1]);
-        blorb_data.exec = exec;
-        write_blorb("out.blb", blorb_data);
-    } catch (const Error &e) {
-        std::cerr << "error: " << e.what() << std::endl;
-        std::exit(1);
-    } catch (const std::ios_base::failure &e) {
-        std::cerr << std::format("error processing {}: {}\n", argv[1], e.code().message());
-        std::exit(1);
-    }
+    write_json(stats_path, statistics.json());
+    write_json(trace_path, trace.json());
+
+#ifdef BPAL_ALLOC_STATS
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << std::format("allocations: {} ({} bytes), elapsed: {:.3f}s\n", allocation_count.load(), allocation_bytes.load(), elapsed.count());
+#endif
 
-    return 0;
+    return ok ? 0 : 1;
 }
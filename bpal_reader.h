@@ -0,0 +1,434 @@
+#ifndef BPAL_BPAL_READER_H
+#define BPAL_BPAL_READER_H
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bpix.h"
+
+// A reader for Blorb files with BPal (or BPIx) chunks, for interpreters.
+//
+// A Blorb is mapped into memory and validated up front, after which
+// nothing is allocated: picture lookups and BPal lookups are a probe or
+// two into flat hash tables. plot() tracks the “Current Palette” as
+// described in Blorb.md, and is meant to be called for every picture an
+// interpreter draws:
+//
+//     bpal_reader::Blorb blorb("game.blb");
+//     ...
+//     auto data = blorb.picture(blorb.plot(number));
+namespace bpal_reader {
+
+class Error : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+constexpr std::uint32_t TypeID(const char (&id)[5])
+{
+    return (static_cast<std::uint32_t>(static_cast<unsigned char>(id[0])) << 24) |
+           (static_cast<std::uint32_t>(static_cast<unsigned char>(id[1])) << 16) |
+           (static_cast<std::uint32_t>(static_cast<unsigned char>(id[2])) <<  8) |
+           (static_cast<std::uint32_t>(static_cast<unsigned char>(id[3])) <<  0);
+}
+
+// A read-only mapping of a whole file.
+class Mapping {
+public:
+    explicit Mapping(const std::string &filename) {
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            throw Error(std::format("unable to open {}: {}", filename, std::strerror(errno)));
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            auto error = errno;
+            close(fd);
+            throw Error(std::format("unable to stat {}: {}", filename, std::strerror(error)));
+        }
+
+        m_size = st.st_size;
+        if (m_size > 0) {
+            m_data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        auto error = errno;
+        close(fd);
+
+        if (m_size > 0 && m_data == MAP_FAILED) {
+            throw Error(std::format("unable to map {}: {}", filename, std::strerror(error)));
+        }
+    }
+
+    ~Mapping() {
+        if (m_data != MAP_FAILED) {
+            munmap(m_data, m_size);
+        }
+    }
+
+    Mapping(Mapping &&other) noexcept : m_data(std::exchange(other.m_data, MAP_FAILED)), m_size(std::exchange(other.m_size, 0)) {
+    }
+
+    Mapping &operator=(Mapping &&other) noexcept {
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        return *this;
+    }
+
+    std::span<const unsigned char> data() const {
+        if (m_data == MAP_FAILED) {
+            return {};
+        }
+
+        return {static_cast<const unsigned char *>(m_data), m_size};
+    }
+
+private:
+    void *m_data = MAP_FAILED;
+    std::size_t m_size = 0;
+};
+
+// An open-addressed hash table from 64-bit keys to nonzero 32-bit values,
+// sized once and never resized. Probing is linear, from a multiplicative
+// hash, so a lookup is usually a single cache line.
+class FlatHash {
+public:
+    FlatHash() = default;
+
+    explicit FlatHash(std::size_t capacity) {
+        // At most half full, which keeps probe sequences short.
+        auto size = std::bit_ceil(std::max<std::size_t>(capacity * 2, 8));
+        m_slots.resize(size);
+        m_shift = 64 - std::countr_zero(size);
+    }
+
+    // Returns false if “key” is already present.
+    bool insert(std::uint64_t key, std::uint32_t value) {
+        for (auto i = slot(key); ; i = (i + 1) & (m_slots.size() - 1)) {
+            if (m_slots[i].value == 0) {
+                m_slots[i] = {key, value};
+                return true;
+            }
+            if (m_slots[i].key == key) {
+                return false;
+            }
+        }
+    }
+
+    // Returns 0 if “key” is absent.
+    std::uint32_t find(std::uint64_t key) const {
+        if (m_slots.empty()) {
+            return 0;
+        }
+
+        for (auto i = slot(key); ; i = (i + 1) & (m_slots.size() - 1)) {
+            if (m_slots[i].value == 0 || m_slots[i].key == key) {
+                return m_slots[i].value;
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        std::uint64_t key = 0;
+        std::uint32_t value = 0;
+    };
+
+    std::vector<Slot> m_slots;
+    int m_shift = 64;
+
+    std::size_t slot(std::uint64_t key) const {
+        return (key * 0x9e3779b97f4a7c15) >> m_shift;
+    }
+};
+
+class Blorb {
+public:
+    // Map and validate a Blorb file.
+    explicit Blorb(const std::string &filename) : m_mapping(filename) {
+        load(m_mapping->data());
+    }
+
+    // Validate a Blorb file which is already in memory; “data” must
+    // outlive the reader.
+    explicit Blorb(std::span<const unsigned char> data) {
+        load(data);
+    }
+
+    // The contents of picture “number”, or an empty span if there is no
+    // such picture.
+    std::span<const unsigned char> picture(std::uint32_t number) const {
+        auto index = m_picture_index.find(number);
+        return index == 0 ? std::span<const unsigned char>() : m_pictures[index - 1].data;
+    }
+
+    // The chunk type of picture “number” (such as 'PNG '), or 0.
+    std::uint32_t picture_type(std::uint32_t number) const {
+        auto index = m_picture_index.find(number);
+        return index == 0 ? 0 : m_pictures[index - 1].type;
+    }
+
+    std::size_t replacements() const {
+        return m_replacements;
+    }
+
+    // The replacement for “requested” when “current” is the current
+    // palette image, or 0 if there is none.
+    std::uint32_t lookup(std::uint32_t current, std::uint32_t requested) const {
+        return m_bpal.find(key(current, requested));
+    }
+
+    // Track the Current Palette for a plot of picture “number”, and
+    // return the number of the picture to draw in its place: its
+    // replacement, if it is an APal image with one for the current
+    // palette, or else “number” itself.
+    std::uint32_t plot(std::uint32_t number) {
+        auto index = m_picture_index.find(number);
+        if (index == 0) {
+            return number;
+        }
+
+        switch (m_pictures[index - 1].kind) {
+        case Kind::palette:
+            m_current = number;
+            return number;
+        case Kind::adaptive:
+            if (m_current.has_value()) {
+                if (auto replacement = lookup(*m_current, number); replacement != 0) {
+                    return replacement;
+                }
+            }
+            return number;
+        case Kind::other:
+            break;
+        }
+
+        return number;
+    }
+
+    std::optional<std::uint32_t> current_palette() const {
+        return m_current;
+    }
+
+    // Forget the current palette, as on restart.
+    void reset() {
+        m_current.reset();
+    }
+
+private:
+    enum class Kind {
+        other,
+        palette,
+        adaptive,
+    };
+
+    struct Picture {
+        std::uint32_t type;
+        Kind kind;
+        std::span<const unsigned char> data;
+    };
+
+    std::optional<Mapping> m_mapping;
+    std::vector<Picture> m_pictures;
+    FlatHash m_picture_index;
+    FlatHash m_bpal;
+    std::size_t m_replacements = 0;
+    std::optional<std::uint32_t> m_current;
+
+    static std::uint64_t key(std::uint32_t current, std::uint32_t requested) {
+        return (static_cast<std::uint64_t>(current) << 32) | requested;
+    }
+
+    static std::uint32_t read32(std::span<const unsigned char> data, std::size_t offset) {
+        return (static_cast<std::uint32_t>(data[offset + 0]) << 24) |
+               (static_cast<std::uint32_t>(data[offset + 1]) << 16) |
+               (static_cast<std::uint32_t>(data[offset + 2]) <<  8) |
+               (static_cast<std::uint32_t>(data[offset + 3]) <<  0);
+    }
+
+    // The payload of the chunk at “offset”, which must lie within
+    // “form”.
+    static std::pair<std::uint32_t, std::span<const unsigned char>> chunk_at(std::span<const unsigned char> form, std::size_t offset) {
+        if (offset < 12 || offset > form.size() || form.size() - offset < 8) {
+            throw Error(std::format("chunk at offset {:x} is outside the file", offset));
+        }
+
+        auto size = read32(form, offset + 4);
+        if (form.size() - offset - 8 < size) {
+            throw Error(std::format("chunk at offset {:x} is truncated", offset));
+        }
+
+        return {read32(form, offset), form.subspan(offset + 8, size)};
+    }
+
+    // Whether “png” has a PLTE chunk, so that its palette can be applied
+    // to APal images.
+    static bool has_palette(std::span<const unsigned char> png) {
+        for (std::size_t offset = 8; offset + 8 <= png.size(); ) {
+            auto size = read32(png, offset);
+            auto type = read32(png, offset + 4);
+
+            if (type == TypeID("PLTE")) {
+                return true;
+            }
+            if (type == TypeID("IDAT") || size > png.size() - offset - 8) {
+                return false;
+            }
+
+            offset += 12 + std::size_t(size);
+        }
+
+        return false;
+    }
+
+    void load(std::span<const unsigned char> data) {
+        if (data.size() < 12 || read32(data, 0) != TypeID("FORM") || read32(data, 8) != TypeID("IFRS")) {
+            throw Error("not a Blorb file");
+        }
+
+        auto form_size = read32(data, 4);
+        if (data.size() - 8 < form_size) {
+            throw Error("Blorb file is truncated");
+        }
+        auto form = data.subspan(0, 8 + form_size);
+
+        auto [ridx_type, ridx] = chunk_at(form, 12);
+        if (ridx_type != TypeID("RIdx") || ridx.size() < 4) {
+            throw Error("first chunk is not RIdx");
+        }
+
+        auto count = read32(ridx, 0);
+        if ((ridx.size() - 4) / 12 != count || (ridx.size() - 4) % 12 != 0) {
+            throw Error("RIdx size does not match its number of entries");
+        }
+
+        m_picture_index = FlatHash(count);
+        for (std::uint32_t i = 0; i < count; i++) {
+            auto usage = read32(ridx, 4 + (i * 12));
+            auto number = read32(ridx, 4 + (i * 12) + 4);
+            auto [type, payload] = chunk_at(form, read32(ridx, 4 + (i * 12) + 8));
+
+            if (usage != TypeID("Pict")) {
+                continue;
+            }
+
+            if (number == 0xffffffff) {
+                throw Error("invalid picture number");
+            }
+
+            m_pictures.emplace_back(type, type == TypeID("PNG ") ? Kind::palette : Kind::other, payload);
+            if (!m_picture_index.insert(number, m_pictures.size())) {
+                throw Error(std::format("picture {} appears more than once in RIdx", number));
+            }
+        }
+
+        std::span<const unsigned char> apal;
+        std::span<const unsigned char> bpal;
+        std::span<const unsigned char> bpix;
+
+        for (std::size_t offset = 12; offset < form.size(); ) {
+            auto [type, payload] = chunk_at(form, offset);
+
+            if (type == TypeID("APal")) {
+                apal = payload;
+            } else if (type == TypeID("BPal")) {
+                bpal = payload;
+            } else if (type == TypeID("BPIx")) {
+                bpix = payload;
+            }
+
+            offset += 8 + payload.size() + (payload.size() % 2);
+        }
+
+        if (apal.size() % 4 != 0) {
+            throw Error("invalid APal size");
+        }
+
+        for (std::size_t i = 0; i < apal.size(); i += 4) {
+            auto index = m_picture_index.find(read32(apal, i));
+            if (index == 0) {
+                throw Error(std::format("APal references image {}, which does not exist", read32(apal, i)));
+            }
+
+            m_pictures[index - 1].kind = Kind::adaptive;
+        }
+
+        std::vector<std::pair<std::uint64_t, std::uint32_t>> entries;
+
+        if (!bpal.empty()) {
+            if (bpal.size() % 12 != 0) {
+                throw Error("invalid BPal size");
+            }
+
+            for (std::size_t i = 0; i < bpal.size(); i += 12) {
+                entries.emplace_back(key(read32(bpal, i), read32(bpal, i + 4)), read32(bpal, i + 8));
+            }
+        } else if (!bpix.empty()) {
+            try {
+                bpix::Table table(bpix);
+                for (const auto current : table.palettes()) {
+                    for (const auto requested : table.apal()) {
+                        if (auto replacement = table.lookup(current, requested); replacement != 0) {
+                            entries.emplace_back(key(current, requested), replacement);
+                        }
+                    }
+                }
+            } catch (const bpix::Error &e) {
+                throw Error(e.what());
+            }
+        }
+
+        m_bpal = FlatHash(entries.size());
+        for (const auto &[k, replacement] : entries) {
+            auto current = static_cast<std::uint32_t>(k >> 32);
+            auto requested = static_cast<std::uint32_t>(k);
+
+            auto find = [this](std::uint32_t number) {
+                auto index = m_picture_index.find(number);
+                return index == 0 ? nullptr : &m_pictures[index - 1];
+            };
+
+            // APal membership decides each picture’s role: the current
+            // palette image must be an indexed PNG outside APal, and the
+            // replacement must not itself be an APal image.
+            auto *palette = find(current);
+            if (palette == nullptr || palette->kind != Kind::palette || !has_palette(palette->data)) {
+                throw Error(std::format("BPal entry ({}, {}): {} is not a current palette image", current, requested, current));
+            }
+            if (auto *apal = find(requested); apal == nullptr || apal->kind != Kind::adaptive) {
+                throw Error(std::format("BPal entry ({}, {}): {} is not an APal image", current, requested, requested));
+            }
+            auto *image = find(replacement);
+            if (replacement == 0 || image == nullptr) {
+                throw Error(std::format("BPal entry ({}, {}): replacement {} does not exist", current, requested, replacement));
+            }
+            if (image->kind == Kind::adaptive) {
+                throw Error(std::format("BPal entry ({}, {}): replacement {} is an APal image", current, requested, replacement));
+            }
+            if (!m_bpal.insert(k, replacement)) {
+                throw Error(std::format("BPal entry ({}, {}) appears more than once", current, requested));
+            }
+        }
+
+        m_replacements = entries.size();
+    }
+};
+
+}
+
+#endif
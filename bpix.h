@@ -0,0 +1,124 @@
+#ifndef BPAL_BPIX_H
+#define BPAL_BPIX_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+// Reference decoder for the Bocfel Adaptive Palette Index chunk ('BPIx';
+// see Blorb.md), a dense form of the BPal table.
+namespace bpix {
+
+class Error : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+class Table {
+public:
+    // Parse the contents of a BPIx chunk.
+    explicit Table(std::span<const unsigned char> chunk) {
+        if (chunk.size() < 12) {
+            throw Error("truncated BPIx chunk");
+        }
+
+        auto palettes = read32(&chunk[0]);
+        auto apal = read32(&chunk[4]);
+        m_cell_size = read32(&chunk[8]);
+
+        if (m_cell_size != 2 && m_cell_size != 4) {
+            throw Error("invalid BPIx cell size");
+        }
+
+        // Counts are at most 2³², so this cannot overflow.
+        auto size = 12 + (std::uint64_t(palettes) + apal) * 4 + std::uint64_t(palettes) * apal * m_cell_size;
+        if (chunk.size() < size) {
+            throw Error("truncated BPIx chunk");
+        }
+
+        auto p = chunk.data() + 12;
+        for (std::uint32_t i = 0; i < palettes; i++, p += 4) {
+            m_palettes.push_back(read32(p));
+        }
+        for (std::uint32_t i = 0; i < apal; i++, p += 4) {
+            m_apal.push_back(read32(p));
+        }
+
+        if (!std::ranges::is_sorted(m_palettes) || !std::ranges::is_sorted(m_apal) ||
+            std::ranges::adjacent_find(m_palettes) != m_palettes.end() || std::ranges::adjacent_find(m_apal) != m_apal.end()) {
+            throw Error("BPIx image lists are not in ascending order");
+        }
+
+        m_grid.assign(p, p + std::size_t(palettes) * apal * m_cell_size);
+
+        m_rows = direct_index(m_palettes);
+        m_columns = direct_index(m_apal);
+    }
+
+    const std::vector<std::uint32_t> &palettes() const { return m_palettes; }
+    const std::vector<std::uint32_t> &apal() const { return m_apal; }
+
+    // The replacement image for “requested” when “current” is the
+    // current palette, or 0 if there is none.
+    std::uint32_t lookup(std::uint32_t current, std::uint32_t requested) const {
+        auto row = index(m_rows, m_palettes, current);
+        auto column = index(m_columns, m_apal, requested);
+
+        if (row == 0 || column == 0) {
+            return 0;
+        }
+
+        auto cell = &m_grid[((row - 1) * m_apal.size() + (column - 1)) * m_cell_size];
+
+        return m_cell_size == 2 ? (cell[0] << 8) | cell[1] : read32(cell);
+    }
+
+private:
+    std::vector<std::uint32_t> m_palettes;
+    std::vector<std::uint32_t> m_apal;
+    std::uint32_t m_cell_size;
+    std::vector<unsigned char> m_grid;
+
+    // Picture numbers are small in practice, so each list gets a table
+    // from picture number to position plus one (zero meaning absent),
+    // making lookups constant time. Lists with larger picture numbers
+    // fall back to binary search.
+    static constexpr std::uint32_t max_direct = 1 << 16;
+    std::vector<std::uint32_t> m_rows;
+    std::vector<std::uint32_t> m_columns;
+
+    static std::uint32_t read32(const unsigned char *p) {
+        return (static_cast<std::uint32_t>(p[0]) << 24) |
+               (static_cast<std::uint32_t>(p[1]) << 16) |
+               (static_cast<std::uint32_t>(p[2]) <<  8) |
+               (static_cast<std::uint32_t>(p[3]) <<  0);
+    }
+
+    static std::vector<std::uint32_t> direct_index(const std::vector<std::uint32_t> &ids) {
+        if (ids.empty() || ids.back() >= max_direct) {
+            return {};
+        }
+
+        std::vector<std::uint32_t> table(ids.back() + 1);
+        for (std::size_t i = 0; i < ids.size(); i++) {
+            table[ids[i]] = i + 1;
+        }
+
+        return table;
+    }
+
+    static std::size_t index(const std::vector<std::uint32_t> &table, const std::vector<std::uint32_t> &ids, std::uint32_t id) {
+        if (!table.empty() || ids.empty()) {
+            return id < table.size() ? table[id] : 0;
+        }
+
+        auto it = std::ranges::lower_bound(ids, id);
+        return it != ids.end() && *it == id ? it - ids.begin() + 1 : 0;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,217 @@
+#ifndef BPAL_BPLT_H
+#define BPAL_BPLT_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Reference decoder for the Bocfel Adaptive Palette Colors chunk ('BPlt';
+// see Blorb.md): parse() reads the chunk, and apply() turns an APal image
+// into its replacement by rewriting the PNG’s PLTE and tRNS chunks. Image
+// data is never decompressed.
+namespace bplt {
+
+class Error : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+struct Color {
+    unsigned char r;
+    unsigned char g;
+    unsigned char b;
+    unsigned char a;
+
+    bool operator==(const Color &) const = default;
+};
+
+struct Entry {
+    std::uint32_t current;
+    std::uint32_t requested;
+
+    // Colors replace the APal image’s palette entries starting at “first”.
+    std::uint16_t first;
+    std::vector<Color> colors;
+
+    bool operator==(const Entry &) const = default;
+};
+
+namespace detail {
+
+inline std::uint32_t read32(const unsigned char *p)
+{
+    return (static_cast<std::uint32_t>(p[0]) << 24) |
+           (static_cast<std::uint32_t>(p[1]) << 16) |
+           (static_cast<std::uint32_t>(p[2]) <<  8) |
+           (static_cast<std::uint32_t>(p[3]) <<  0);
+}
+
+inline void write32(std::vector<unsigned char> &out, std::uint32_t n)
+{
+    out.push_back(n >> 24);
+    out.push_back((n >> 16) & 0xff);
+    out.push_back((n >>  8) & 0xff);
+    out.push_back(n & 0xff);
+}
+
+inline std::uint32_t crc32(std::span<const unsigned char> data, std::uint32_t crc = 0)
+{
+    static const auto table = [] {
+        std::array<std::uint32_t, 256> table;
+        for (std::uint32_t n = 0; n < 256; n++) {
+            auto c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        return table;
+    }();
+
+    crc = ~crc;
+    for (const auto byte : data) {
+        crc = table[(crc ^ byte) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+inline void write_png_chunk(std::vector<unsigned char> &out, const char (&type)[5], std::span<const unsigned char> data)
+{
+    write32(out, data.size());
+    auto start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    write32(out, crc32(std::span(out).subspan(start)));
+}
+
+}
+
+// Parse the contents of a BPlt chunk.
+inline std::vector<Entry> parse(std::span<const unsigned char> chunk)
+{
+    std::vector<Entry> entries;
+
+    while (!chunk.empty()) {
+        if (chunk.size() < 12) {
+            throw Error("truncated BPlt entry");
+        }
+
+        Entry entry;
+        entry.current = detail::read32(&chunk[0]);
+        entry.requested = detail::read32(&chunk[4]);
+        entry.first = (chunk[8] << 8) | chunk[9];
+        std::size_t count = (chunk[10] << 8) | chunk[11];
+        chunk = chunk.subspan(12);
+
+        if (chunk.size() < count * 4) {
+            throw Error("truncated BPlt entry");
+        }
+
+        for (std::size_t i = 0; i < count; i++) {
+            entry.colors.emplace_back(chunk[i * 4 + 0], chunk[i * 4 + 1], chunk[i * 4 + 2], chunk[i * 4 + 3]);
+        }
+        chunk = chunk.subspan(count * 4);
+
+        entries.push_back(std::move(entry));
+    }
+
+    return entries;
+}
+
+// Return a copy of the PNG image “png” with the colors of “entry”
+// substituted into its palette. Colors past the end of the palette are
+// ignored, and an image without a palette is returned unchanged.
+inline std::vector<unsigned char> apply(std::span<const unsigned char> png, const Entry &entry)
+{
+    static constexpr unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+    if (png.size() < sizeof signature || std::memcmp(png.data(), signature, sizeof signature) != 0) {
+        throw Error("not a PNG image");
+    }
+
+    struct PngChunk {
+        std::string type;
+        std::span<const unsigned char> data;
+        std::span<const unsigned char> whole;
+    };
+
+    std::vector<PngChunk> chunks;
+    for (auto rest = png.subspan(sizeof signature); !rest.empty(); ) {
+        if (rest.size() < 12) {
+            throw Error("truncated PNG chunk");
+        }
+
+        auto length = detail::read32(rest.data());
+        if (rest.size() - 12 < length) {
+            throw Error("truncated PNG chunk");
+        }
+
+        chunks.emplace_back(std::string(reinterpret_cast<const char *>(&rest[4]), 4), rest.subspan(8, length), rest.subspan(0, 12 + length));
+        rest = rest.subspan(12 + length);
+    }
+
+    const PngChunk *plte = nullptr;
+    const PngChunk *trns = nullptr;
+    for (const auto &chunk : chunks) {
+        if (chunk.type == "PLTE") {
+            plte = &chunk;
+        } else if (chunk.type == "tRNS") {
+            trns = &chunk;
+        }
+    }
+
+    // Color type 3 is indexed color; other images may carry a suggested
+    // palette, which does not affect how they look.
+    if (chunks.empty() || chunks[0].type != "IHDR" || chunks[0].data.size() < 13 || chunks[0].data[9] != 3 || plte == nullptr) {
+        return {png.begin(), png.end()};
+    }
+
+    std::vector<unsigned char> palette(plte->data.begin(), plte->data.end());
+    std::size_t size = palette.size() / 3;
+
+    std::vector<unsigned char> alpha(size, 0xff);
+    if (trns != nullptr) {
+        std::copy_n(trns->data.begin(), std::min(trns->data.size(), size), alpha.begin());
+    }
+
+    for (std::size_t i = 0; i < entry.colors.size() && entry.first + i < size; i++) {
+        const auto &color = entry.colors[i];
+        auto index = entry.first + i;
+
+        palette[index * 3 + 0] = color.r;
+        palette[index * 3 + 1] = color.g;
+        palette[index * 3 + 2] = color.b;
+        alpha[index] = color.a;
+    }
+
+    // tRNS only needs to reach the last translucent entry.
+    while (!alpha.empty() && alpha.back() == 0xff) {
+        alpha.pop_back();
+    }
+
+    std::vector<unsigned char> out(png.begin(), png.begin() + sizeof signature);
+    out.reserve(png.size() + 12 + size);
+
+    for (const auto &chunk : chunks) {
+        if (chunk.type == "PLTE") {
+            detail::write_png_chunk(out, "PLTE", palette);
+            if (!alpha.empty()) {
+                detail::write_png_chunk(out, "tRNS", alpha);
+            }
+        } else if (chunk.type != "tRNS") {
+            out.insert(out.end(), chunk.whole.begin(), chunk.whole.end());
+        }
+    }
+
+    return out;
+}
+
+}
+
+#endif
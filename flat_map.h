@@ -0,0 +1,150 @@
+#ifndef BPAL_FLAT_MAP_H
+#define BPAL_FLAT_MAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Tag for adopting a container which is already sorted and free of
+// duplicate keys, as with std::flat_map.
+struct sorted_unique_t {
+    explicit sorted_unique_t() = default;
+};
+inline constexpr sorted_unique_t sorted_unique{};
+
+// Sorted, contiguous replacements for std::map and std::set. Lookups are
+// binary searches over a single array, and iteration is in ascending key
+// order, just as with the node-based containers.
+//
+// Resources in a Blorb are nearly always added in ascending order, so
+// insertion checks the end first: appending is amortized constant time,
+// and only out-of-order keys pay for a search and element shifting. When
+// keys are likely to be out of order, sort them up front and adopt them
+// with sorted_unique instead.
+template <typename Key, typename T, typename Container = std::vector<std::pair<Key, T>>>
+class FlatMap {
+public:
+    using key_type = Key;
+    using mapped_type = T;
+    using value_type = typename Container::value_type;
+    using allocator_type = typename Container::allocator_type;
+    using iterator = typename Container::iterator;
+    using const_iterator = typename Container::const_iterator;
+
+    FlatMap() = default;
+    explicit FlatMap(const allocator_type &alloc) : m_entries(alloc) {
+    }
+    FlatMap(sorted_unique_t, Container entries) : m_entries(std::move(entries)) {
+    }
+
+    iterator begin() { return m_entries.begin(); }
+    iterator end() { return m_entries.end(); }
+    const_iterator begin() const { return m_entries.begin(); }
+    const_iterator end() const { return m_entries.end(); }
+
+    std::size_t size() const { return m_entries.size(); }
+    bool empty() const { return m_entries.empty(); }
+    void reserve(std::size_t n) { m_entries.reserve(n); }
+
+    template <typename... Args>
+    std::pair<iterator, bool> emplace(const Key &key, Args &&...args) {
+        auto it = m_entries.end();
+
+        if (!m_entries.empty() && !(m_entries.back().first < key)) {
+            it = lower_bound(key);
+            if (it != m_entries.end() && it->first == key) {
+                return {it, false};
+            }
+        }
+
+        it = m_entries.emplace(it, std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+
+        return {it, true};
+    }
+
+    iterator find(const Key &key) {
+        auto it = lower_bound(key);
+        return it != m_entries.end() && it->first == key ? it : m_entries.end();
+    }
+
+    const_iterator find(const Key &key) const {
+        auto it = lower_bound(key);
+        return it != m_entries.end() && it->first == key ? it : m_entries.end();
+    }
+
+    bool contains(const Key &key) const {
+        return find(key) != m_entries.end();
+    }
+
+    T &at(const Key &key) {
+        auto it = find(key);
+        if (it == m_entries.end()) {
+            throw std::out_of_range("FlatMap::at");
+        }
+
+        return it->second;
+    }
+
+    const T &at(const Key &key) const {
+        auto it = find(key);
+        if (it == m_entries.end()) {
+            throw std::out_of_range("FlatMap::at");
+        }
+
+        return it->second;
+    }
+
+private:
+    Container m_entries;
+
+    iterator lower_bound(const Key &key) {
+        return std::ranges::lower_bound(m_entries, key, std::less<>(), &value_type::first);
+    }
+
+    const_iterator lower_bound(const Key &key) const {
+        return std::ranges::lower_bound(m_entries, key, std::less<>(), &value_type::first);
+    }
+};
+
+template <typename Key, typename Container = std::vector<Key>>
+class FlatSet {
+public:
+    using key_type = Key;
+    using value_type = Key;
+    using const_iterator = typename Container::const_iterator;
+    using iterator = const_iterator;
+
+    const_iterator begin() const { return m_keys.begin(); }
+    const_iterator end() const { return m_keys.end(); }
+
+    std::size_t size() const { return m_keys.size(); }
+    bool empty() const { return m_keys.empty(); }
+    void reserve(std::size_t n) { m_keys.reserve(n); }
+
+    std::pair<const_iterator, bool> insert(const Key &key) {
+        auto it = m_keys.end();
+
+        if (!m_keys.empty() && !(m_keys.back() < key)) {
+            it = std::ranges::lower_bound(m_keys, key);
+            if (it != m_keys.end() && *it == key) {
+                return {it, false};
+            }
+        }
+
+        return {m_keys.insert(it, key), true};
+    }
+
+    bool contains(const Key &key) const {
+        return std::ranges::binary_search(m_keys, key);
+    }
+
+private:
+    Container m_keys;
+};
+
+#endif
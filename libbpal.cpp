@@ -0,0 +1,2695 @@
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <format>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <ranges>
+#include <shared_mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <QBuffer>
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QCryptographicHash>
+#include <QIODevice>
+#include <QImage>
+#include <QtGlobal>
+
+#include <sys/resource.h>
+
+#include "blit.h"
+#include "libbpal.h"
+#include "probes.h"
+
+#ifdef LIBOXI
+#include "oxi.h"
+#else
+#include <boost/process.hpp>
+
+namespace bp = boost::process;
+#endif
+
+namespace bpal {
+
+std::string idstr(std::uint32_t id)
+{
+    auto aschar = [](unsigned char c) -> char { return std::isprint(c) ? c : ' '; };
+
+    return {
+        aschar(id >> 24),
+        aschar((id >> 16) & 0xff),
+        aschar((id >>  8) & 0xff),
+        aschar(id & 0xff)
+    };
+}
+
+Digest digest(std::span<const unsigned char> data)
+{
+    auto hash = QCryptographicHash::hash(QByteArrayView(data.data(), data.size()), QCryptographicHash::Sha256);
+    Digest digest;
+
+    std::memcpy(digest.bytes.data(), hash.constData(), digest.bytes.size());
+
+    return digest;
+}
+
+// Combine two digests into one, for keys made of two images.
+static Digest combine(const Digest &a, const Digest &b)
+{
+    std::array<unsigned char, 64> bytes;
+
+    std::ranges::copy(a.bytes, bytes.begin());
+    std::ranges::copy(b.bytes, bytes.begin() + a.bytes.size());
+
+    return digest(bytes);
+}
+
+struct DecodedImages {
+    DigestCache<QImage> apal;
+    DigestCache<std::shared_ptr<const QList<QRgb>>> palettes;
+};
+
+// Memory held by cached images, for Statistics.
+static std::size_t image_bytes(const QImage &image)
+{
+    return image.sizeInBytes() + (image.colorTable().size() * sizeof(QRgb));
+}
+
+static std::size_t palette_bytes(const std::shared_ptr<const QList<QRgb>> &palette)
+{
+    return palette->size() * sizeof(QRgb);
+}
+
+static std::size_t png_bytes(const ContentCache::value_type &png)
+{
+    return png->size();
+}
+
+static unsigned int thread_count(unsigned int threads)
+{
+    return threads != 0 ? threads : std::max(1U, std::thread::hardware_concurrency());
+}
+
+Context::Context(Options options) :
+    m_options(std::move(options)),
+    m_decoded(std::make_unique<DecodedImages>()),
+    m_pool(thread_count(m_options.threads) - 1)
+{
+}
+
+Context::~Context() = default;
+
+CacheStats Context::cache_stats() const
+{
+    return {
+        .compressed = m_compressed.size(),
+        .replacements = m_replacements.size(),
+        .apal_images = m_decoded->apal.size(),
+        .palettes = m_decoded->palettes.size(),
+    };
+}
+
+void Context::status(std::string_view message) const
+{
+    if (m_options.status) {
+        m_options.status(message);
+    }
+}
+
+void Context::clear_caches()
+{
+    std::unique_lock lock(m_jobs);
+
+    if (auto *statistics = m_options.statistics) {
+        auto keys = m_compressed.size() + (2 * m_replacements.size()) + m_decoded->apal.size() + m_decoded->palettes.size();
+
+        statistics->add_memory(Statistics::Memory::compressed, -static_cast<std::ptrdiff_t>(m_compressed.sum(png_bytes)));
+        statistics->add_memory(Statistics::Memory::decoded, -static_cast<std::ptrdiff_t>(m_decoded->apal.sum(image_bytes) + m_decoded->palettes.sum(palette_bytes)));
+        statistics->add_memory(Statistics::Memory::keys, -static_cast<std::ptrdiff_t>(keys * sizeof(Digest)));
+    }
+
+    m_compressed.clear();
+    m_replacements.clear();
+    m_decoded->apal.clear();
+    m_decoded->palettes.clear();
+}
+
+void Context::trim_caches()
+{
+    std::unique_lock lock(m_jobs, std::try_to_lock);
+    if (m_options.cache_limit == 0 || !lock.owns_lock()) {
+        return;
+    }
+
+    auto limit = m_options.cache_limit;
+    auto compressed = m_compressed.sum(png_bytes);
+    auto apal = m_decoded->apal.sum(image_bytes);
+    auto palettes = m_decoded->palettes.sum(palette_bytes);
+
+    auto budget = [limit](std::size_t used) {
+        return limit - std::min(limit, used);
+    };
+
+    auto [apal_entries, apal_freed] = m_decoded->apal.evict(budget(compressed + palettes), image_bytes);
+    apal -= apal_freed;
+    auto [palette_entries, palette_freed] = m_decoded->palettes.evict(budget(compressed + apal), palette_bytes);
+    palettes -= palette_freed;
+    auto [compressed_entries, compressed_freed] = m_compressed.evict(budget(apal + palettes), png_bytes);
+
+    // A replacement whose compressed image is gone would be converted
+    // again anyway, so its entry is only taking up room.
+    auto replacement_entries = m_replacements.erase_if([this](const Digest &converted) {
+        return !m_compressed.find(converted).has_value();
+    });
+
+    if (auto *statistics = m_options.statistics) {
+        auto keys = apal_entries + palette_entries + compressed_entries + (2 * replacement_entries);
+
+        statistics->add_memory(Statistics::Memory::compressed, -static_cast<std::ptrdiff_t>(compressed_freed));
+        statistics->add_memory(Statistics::Memory::decoded, -static_cast<std::ptrdiff_t>(apal_freed + palette_freed));
+        statistics->add_memory(Statistics::Memory::keys, -static_cast<std::ptrdiff_t>(keys * sizeof(Digest)));
+    }
+}
+
+void Statistics::add_time(Stage stage, double wall, double cpu)
+{
+    std::lock_guard lock(m_mutex);
+    auto &time = m_times[static_cast<std::size_t>(stage)];
+
+    time.wall += wall;
+    time.cpu += cpu;
+    time.count++;
+}
+
+void Statistics::add_rss(Stage stage, std::size_t before, std::size_t after)
+{
+    std::lock_guard lock(m_mutex);
+    auto &rss = m_rss[static_cast<std::size_t>(stage)];
+
+    rss.peak = std::max(rss.peak, after);
+    rss.growth += after - std::min(before, after);
+}
+
+void Statistics::add_bytes(std::size_t in, std::size_t out)
+{
+    std::lock_guard lock(m_mutex);
+
+    m_bytes_in += in;
+    m_bytes_out += out;
+}
+
+void Statistics::add_memory(Memory category, std::ptrdiff_t bytes)
+{
+    std::lock_guard lock(m_mutex);
+
+    for (auto *usage : {&m_memory[static_cast<std::size_t>(category)], &m_memory_total}) {
+        usage->live += bytes;
+        usage->peak = std::max(usage->peak, usage->live);
+    }
+}
+
+void Statistics::add_dedup(std::size_t pairs, std::size_t unique)
+{
+    std::lock_guard lock(m_mutex);
+
+    m_pairs += pairs;
+    m_unique += unique;
+}
+
+void Statistics::add_compressed(std::size_t before, std::size_t after, double seconds)
+{
+    std::lock_guard lock(m_mutex);
+
+    m_compressed_in += before;
+    m_compressed_out += after;
+    m_ratios.push_back(before == 0 ? 1.0 : static_cast<double>(after) / before);
+    m_latencies.push_back(seconds);
+}
+
+static constexpr std::array<const char *, Statistics::stages> stage_names = {
+    "parse", "discover", "decode", "convert", "dedup", "compress", "write",
+};
+
+static constexpr std::array<const char *, Statistics::memory_categories> memory_names = {
+    "input", "decoded", "uncompressed", "compressed", "keys",
+};
+
+// The process’s peak resident set size so far, in bytes.
+static std::size_t peak_rss()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // Linux reports kilobytes.
+    return static_cast<std::size_t>(usage.ru_maxrss) * 1024;
+}
+
+// CPU time used by the process, including its threads and any child
+// processes which have been waited for.
+static double process_cpu_seconds()
+{
+    double seconds = 0;
+
+    for (const auto who : {RUSAGE_SELF, RUSAGE_CHILDREN}) {
+        rusage usage;
+        getrusage(who, &usage);
+        seconds += usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + ((usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6);
+    }
+
+    return seconds;
+}
+
+std::string Statistics::json() const
+{
+    std::lock_guard lock(m_mutex);
+
+    // Nearest-rank percentiles of a sorted list.
+    auto percentile = [](const std::vector<double> &sorted, double p) {
+        if (sorted.empty()) {
+            return 0.0;
+        }
+
+        auto rank = static_cast<std::size_t>(std::ceil(p / 100 * sorted.size()));
+        return sorted[std::clamp<std::size_t>(rank, 1, sorted.size()) - 1];
+    };
+
+    auto ratios = m_ratios;
+    auto latencies = m_latencies;
+    std::ranges::sort(ratios);
+    std::ranges::sort(latencies);
+
+    std::string out = "{\n  \"stages\": {\n";
+    for (const auto &[i, name] : std::views::enumerate(stage_names)) {
+        const auto &time = m_times[i];
+        const auto &rss = m_rss[i];
+        out += std::format("    \"{}\": {{\"wall_s\": {:.6f}, \"cpu_s\": {:.6f}, \"count\": {}, \"peak_rss\": {}, \"rss_growth\": {}}}{}\n",
+                name, time.wall, time.cpu, time.count, rss.peak, rss.growth, i + 1 < static_cast<std::ptrdiff_t>(stage_names.size()) ? "," : "");
+    }
+    out += "  },\n";
+
+    out += "  \"memory\": {\n";
+    for (const auto &[i, name] : std::views::enumerate(memory_names)) {
+        out += std::format("    \"{}\": {{\"live\": {}, \"peak\": {}}},\n", name, m_memory[i].live, m_memory[i].peak);
+    }
+    out += std::format("    \"total\": {{\"live\": {}, \"peak\": {}}},\n", m_memory_total.live, m_memory_total.peak);
+    out += std::format("    \"peak_rss\": {}\n", peak_rss());
+    out += "  },\n";
+
+    out += std::format("  \"bytes\": {{\"in\": {}, \"out\": {}}},\n", m_bytes_in, m_bytes_out);
+
+    out += std::format("  \"dedup\": {{\"pairs\": {}, \"unique\": {}, \"hit_rate\": {:.6f}}},\n",
+            m_pairs, m_unique, m_pairs == 0 ? 0.0 : 1.0 - static_cast<double>(m_unique) / m_pairs);
+
+    auto mean = ratios.empty() ? 0.0 : std::accumulate(ratios.begin(), ratios.end(), 0.0) / ratios.size();
+    out += std::format("  \"compress\": {{\n"
+                       "    \"images\": {}, \"bytes_in\": {}, \"bytes_out\": {},\n"
+                       "    \"ratio\": {{\"min\": {:.4f}, \"p50\": {:.4f}, \"p90\": {:.4f}, \"max\": {:.4f}, \"mean\": {:.4f}}},\n"
+                       "    \"latency_ms\": {{\"p50\": {:.3f}, \"p90\": {:.3f}, \"p99\": {:.3f}, \"max\": {:.3f}}}\n"
+                       "  }}\n",
+            ratios.size(), m_compressed_in, m_compressed_out,
+            ratios.empty() ? 0.0 : ratios.front(), percentile(ratios, 50), percentile(ratios, 90), ratios.empty() ? 0.0 : ratios.back(), mean,
+            percentile(latencies, 50) * 1000, percentile(latencies, 90) * 1000, percentile(latencies, 99) * 1000, latencies.empty() ? 0.0 : latencies.back() * 1000);
+
+    out += "}\n";
+
+    return out;
+}
+
+void Trace::add(const char *name, Clock::time_point start, Pictures pictures)
+{
+    auto end = Clock::now();
+    std::lock_guard lock(m_mutex);
+    auto [it, _] = m_threads.try_emplace(std::this_thread::get_id(), m_threads.size() + 1);
+
+    m_events.emplace_back(name, start, end, it->second, pictures);
+}
+
+std::string Trace::json() const
+{
+    std::lock_guard lock(m_mutex);
+
+    auto us = [this](Clock::time_point t) {
+        return std::chrono::duration<double, std::micro>(t - m_origin).count();
+    };
+
+    std::string out = "{\"traceEvents\": [\n";
+
+    for (std::size_t thread = 1; thread <= m_threads.size(); thread++) {
+        out += std::format("{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": {}, \"args\": {{\"name\": \"thread {}\"}}}},\n",
+                thread, thread);
+    }
+
+    for (const auto &[i, event] : std::views::enumerate(m_events)) {
+        std::string args;
+        if (event.pictures.picture.has_value()) {
+            args += std::format("\"picture\": {}", *event.pictures.picture);
+        }
+        if (event.pictures.palette.has_value()) {
+            args += std::format("{}\"palette\": {}", args.empty() ? "" : ", ", *event.pictures.palette);
+        }
+
+        out += std::format("{{\"name\": \"{}\", \"ph\": \"X\", \"pid\": 1, \"tid\": {}, \"ts\": {:.3f}, \"dur\": {:.3f}, \"args\": {{{}}}}}{}\n",
+                event.name, event.thread, us(event.start), us(event.end) - us(event.start), args,
+                i + 1 < static_cast<std::ptrdiff_t>(m_events.size()) ? "," : "");
+    }
+
+    out += "]}\n";
+
+    return out;
+}
+
+namespace {
+
+// Adds an event from its construction to its destruction to “trace”,
+// if there is one.
+class TraceScope {
+public:
+    TraceScope(Trace *trace, const char *name, Trace::Pictures pictures = {}) :
+        m_trace(trace),
+        m_name(name),
+        m_pictures(pictures)
+    {
+        if (m_trace != nullptr) {
+            m_start = Trace::Clock::now();
+        }
+    }
+
+    ~TraceScope() {
+        if (m_trace != nullptr) {
+            m_trace->add(m_name, m_start, m_pictures);
+        }
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    Trace *m_trace;
+    const char *m_name;
+    Trace::Pictures m_pictures;
+    Trace::Clock::time_point m_start;
+};
+
+double cpu_seconds(clockid_t clock)
+{
+    timespec ts;
+    clock_gettime(clock, &ts);
+
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+// Adds the time from its construction to its destruction to a stage,
+// when the Context is collecting statistics, and to the trace as an
+// event named after the stage. Stages timed for the whole process also
+// record the peak resident set size.
+class StageTimer {
+public:
+    enum class Scope { process, thread };
+
+    StageTimer(const Context &context, Statistics::Stage stage, Scope scope = Scope::process, Trace::Pictures pictures = {}) :
+        m_trace(context.trace(), stage_names[static_cast<std::size_t>(stage)], pictures),
+        m_statistics(context.statistics()),
+        m_stage(stage),
+        m_scope(scope),
+        m_clock(scope == Scope::thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID)
+    {
+        if (m_statistics != nullptr) {
+            m_start = std::chrono::steady_clock::now();
+            m_cpu_start = cpu_seconds(m_clock);
+            if (m_scope == Scope::process) {
+                m_rss_start = peak_rss();
+            }
+        }
+    }
+
+    ~StageTimer() {
+        if (m_statistics != nullptr) {
+            m_statistics->add_time(m_stage, elapsed(), cpu_seconds(m_clock) - m_cpu_start);
+            if (m_scope == Scope::process) {
+                m_statistics->add_rss(m_stage, m_rss_start, peak_rss());
+            }
+        }
+    }
+
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+
+    double elapsed() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    }
+
+private:
+    TraceScope m_trace;
+    Statistics *m_statistics;
+    Statistics::Stage m_stage;
+    Scope m_scope;
+    clockid_t m_clock;
+    std::chrono::steady_clock::time_point m_start;
+    double m_cpu_start = 0;
+    std::size_t m_rss_start = 0;
+};
+
+// Adds “bytes” to a memory category, when the Context is collecting
+// statistics.
+void account(const Context &context, Statistics::Memory category, std::ptrdiff_t bytes)
+{
+    if (auto *statistics = context.statistics()) {
+        statistics->add_memory(category, bytes);
+    }
+}
+
+// Holds “bytes” in a memory category from its construction to its
+// destruction.
+class MemoryScope {
+public:
+    MemoryScope(const Context &context, Statistics::Memory category, std::size_t bytes) :
+        m_context(context),
+        m_category(category),
+        m_bytes(bytes)
+    {
+        account(m_context, m_category, m_bytes);
+    }
+
+    ~MemoryScope() {
+        account(m_context, m_category, -static_cast<std::ptrdiff_t>(m_bytes));
+    }
+
+    MemoryScope(const MemoryScope &) = delete;
+    MemoryScope &operator=(const MemoryScope &) = delete;
+
+private:
+    const Context &m_context;
+    Statistics::Memory m_category;
+    std::size_t m_bytes;
+};
+
+std::size_t chunk_bytes(const BlorbData &blorb_data)
+{
+    std::size_t bytes = 0;
+
+    for (const auto &chunk : blorb_data.chunks) {
+        bytes += chunk.data.size();
+    }
+    for (const auto &[_, chunk] : blorb_data.picts) {
+        bytes += chunk.data.size();
+    }
+    if (blorb_data.exec.has_value()) {
+        bytes += blorb_data.exec->size();
+    }
+
+    return bytes;
+}
+
+std::size_t conversion_bytes(const Conversion &conversion)
+{
+    std::size_t bytes = 0;
+
+    for (const auto &image : conversion.images) {
+        bytes += image.size();
+    }
+
+    return bytes;
+}
+
+}
+
+static QImage qimage_from_data(const std::span<const unsigned char> data)
+{
+    QImage image;
+
+    if (!image.loadFromData(data.data(), data.size(), "PNG")) {
+        throw Error("unable to load PNG");
+    }
+
+    return image;
+}
+
+// qimage_from_data() for picture “id”, with probes.
+static QImage decode_picture(std::uint32_t id, const std::span<const unsigned char> data)
+{
+    BPAL_PROBE2(decode__start, id, data.size());
+    auto image = qimage_from_data(data);
+    BPAL_PROBE3(decode__done, id, image.width(), image.height());
+
+    return image;
+}
+
+// Only the color table of a current palette image is ever used.
+static QList<QRgb> palette_from_image(const QImage &palette)
+{
+    if (palette.format() != QImage::Format_Indexed8) {
+        throw Error("palette source not indexed");
+    }
+
+    return palette.colorTable();
+}
+
+// Decoded images are shared through the Context, keyed by digest.
+static std::shared_ptr<const QList<QRgb>> decoded_palette(Context &context, std::uint32_t id, const Digest &digest, std::span<const unsigned char> data)
+{
+    auto &cache = context.decoded().palettes;
+    auto cached = cache.find(digest);
+
+    if (cached.has_value()) {
+        return *cached;
+    }
+
+    StageTimer timer(context, Statistics::Stage::decode, StageTimer::Scope::thread, {id});
+    auto [palette, inserted] = cache.emplace(digest, std::make_shared<const QList<QRgb>>(palette_from_image(decode_picture(id, data))));
+    if (inserted) {
+        account(context, Statistics::Memory::decoded, palette_bytes(palette));
+        account(context, Statistics::Memory::keys, sizeof(Digest));
+    }
+
+    return palette;
+}
+
+static QImage decoded_apal(Context &context, std::uint32_t id, const Digest &digest, std::span<const unsigned char> data)
+{
+    auto &cache = context.decoded().apal;
+    auto cached = cache.find(digest);
+
+    if (cached.has_value()) {
+        return *cached;
+    }
+
+    StageTimer timer(context, Statistics::Stage::decode, StageTimer::Scope::thread, {id});
+    auto [image, inserted] = cache.emplace(digest, decode_picture(id, data));
+    if (inserted) {
+        account(context, Statistics::Memory::decoded, image_bytes(image));
+        account(context, Statistics::Memory::keys, sizeof(Digest));
+    }
+
+    return image;
+}
+
+// “preset” is an oxipng optimization level, from 0 to 6.
+static std::vector<unsigned char> compress_png(const std::span<const unsigned char> png, int preset = 6)
+{
+#ifdef LIBOXI
+    auto compressed = optimize_png_preset(png.data(), png.size(), preset);
+    if (compressed.data == nullptr) {
+        throw Error("unable to compress image");
+    }
+
+    auto freefn = [](unsigned char *p) { std::free(p); };
+    std::unique_ptr<unsigned char, decltype(freefn)> free_png(compressed.data, freefn);
+
+    return {compressed.data, compressed.data + compressed.size};
+#else
+    bp::ipstream out;
+    bp::opstream in;
+
+    bp::child c("/usr/bin/oxipng", std::format("-o{}", preset), "-q", "--stdout", "-", bp::std_in < in, bp::std_out > out);
+
+    in.write(reinterpret_cast<const char *>(png.data()), png.size());
+    in.flush();
+    in.pipe().close();
+
+    c.wait();
+    if (c.exit_code() != 0) {
+        throw Error(std::format("optipng exited {}", c.exit_code()));
+    }
+
+    return {std::istreambuf_iterator<char>(out), std::istreambuf_iterator<char>()};
+#endif
+}
+
+static void apply_palette(QImage &apal_image, const QList<QRgb> &src)
+{
+    auto dst = apal_image.colorTable();
+
+    for (int i = 2; i < qMin(src.size(), dst.size()); i++) {
+        dst[i] = src[i];
+    }
+
+    apal_image.setColorTable(dst);
+}
+
+// The PNG image is stored in “scratch”, which is reused across calls so
+// that its buffer is only reallocated when an image larger than any
+// previous one is encountered. Opening with Truncate empties it first but
+// keeps its capacity; WriteOnly alone would only rewind, leaving the tail
+// of a larger previous image after this one. The returned span is valid
+// until the next call using the same scratch buffer.
+static std::span<const unsigned char> save_png(const QImage &image, QByteArray &scratch)
+{
+    QBuffer buffer(&scratch);
+
+    if (!buffer.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        throw Error("unable to open QBuffer");
+    }
+
+    if (!image.save(&buffer, "PNG", 100)) {
+        throw Error("unable to store image as PNG");
+    }
+
+    return {reinterpret_cast<const unsigned char *>(scratch.constData()), static_cast<std::size_t>(scratch.size())};
+}
+
+static std::span<const unsigned char> convert_palette(QImage apal_image, const QList<QRgb> &src, QByteArray &scratch)
+{
+    apply_palette(apal_image, src);
+
+    return save_png(apal_image, scratch);
+}
+
+FlatSet<std::uint32_t> find_apal_images(const std::span<const Chunk> chunks)
+{
+    auto apal = std::find_if(chunks.begin(), chunks.end(), [](const auto &chunk) {
+        return chunk.type == TypeID("APal");
+    });
+
+    if (apal == chunks.end()) {
+        throw Error("no APal chunk found");
+    }
+
+    if (apal->data.size() % 4 != 0) {
+        throw Error(std::format("invalid APal size: {}", apal->data.size()));
+    }
+
+    FlatSet<std::uint32_t> apal_images;
+    apal_images.reserve(apal->data.size() / 4);
+
+    for (std::size_t i = 0; i < apal->data.size(); i += 4) {
+        auto id = be32(apal->data[i + 0], apal->data[i + 1], apal->data[i + 2], apal->data[i + 3]);
+
+        apal_images.insert(id);
+    }
+
+    return apal_images;
+}
+
+namespace {
+
+class Reader {
+public:
+    explicit Reader(std::span<const unsigned char> data) : m_data(data) {
+    }
+
+    std::size_t tell() const {
+        return m_pos;
+    }
+
+    std::span<const unsigned char> read(std::size_t n) {
+        if (n > m_data.size() - m_pos) {
+            throw Error(std::format("unexpected end of file at offset {:x}", m_pos));
+        }
+
+        auto data = m_data.subspan(m_pos, n);
+        m_pos += n;
+
+        return data;
+    }
+
+    std::uint32_t read32() {
+        auto data = read(4);
+
+        return be32(data[0], data[1], data[2], data[3]);
+    }
+
+private:
+    std::span<const unsigned char> m_data;
+    std::size_t m_pos = 0;
+};
+
+}
+
+BlorbData parse(std::span<const unsigned char> blorb, bool generated)
+{
+    BPAL_PROBE1(parse__start, blorb.size());
+
+    BlorbData blorb_data;
+    Reader reader(blorb);
+
+    if (reader.read32() != TypeID("FORM")) {
+        throw Error("not a blorb");
+    }
+
+    auto size = reader.read32();
+
+    if (reader.read32() != TypeID("IFRS") || reader.read32() != TypeID("RIdx")) {
+        throw Error("not a blorb");
+    }
+
+    // Map offsets to IDs.
+    std::vector<std::pair<std::size_t, std::uint32_t>> offsets;
+    auto n = reader.read32();
+    auto num = reader.read32();
+    if (n != ((num * 12) + 4)) {
+        throw Error("RIdx mismatch");
+    }
+
+    std::optional<std::size_t> exec_offset;
+    std::vector<BPalEntry> matrix;
+
+    offsets.reserve(num);
+    blorb_data.picts.reserve(num);
+
+    for (size_t i = 0; i < num; i++) {
+        auto usage = reader.read32();
+        auto number = reader.read32();
+        auto start = reader.read32();
+
+        if (generated && usage == TypeID("Exec")) {
+            exec_offset = start;
+            continue;
+        }
+
+        if (usage != TypeID("Pict")) {
+            throw Error(std::format("unknown resource usage: {:08x} ({})", usage, idstr(usage)));
+        }
+
+        blorb_data.next_id = std::max(blorb_data.next_id, number + 1);
+
+        offsets.emplace_back(start, number);
+    }
+
+    // RIdx entries need not be in offset order, so sort once rather than
+    // inserting each into place.
+    std::ranges::stable_sort(offsets, {}, &decltype(offsets)::value_type::first);
+
+    // This is legal but neither Arthur nor Zork Zero does it.
+    if (auto dup = std::ranges::adjacent_find(offsets, {}, &decltype(offsets)::value_type::first); dup != offsets.end()) {
+        throw Error(std::format("duplicate offset {:x} for id {}", dup->first, std::next(dup)->second));
+    }
+
+    FlatMap<std::size_t, std::uint32_t> ids(sorted_unique, std::move(offsets));
+
+    while (reader.tell() < static_cast<std::size_t>(size) + 8) {
+        auto pos = reader.tell();
+        auto chunktype = reader.read32();
+
+        auto size = reader.read32();
+        auto data = reader.read(size);
+        Bytes chunk(data.begin(), data.end(), blorb_data.arena.get());
+        if (size % 2 == 1) {
+            reader.read(1);
+        }
+
+        switch (chunktype) {
+        case TypeID("IFhd"): case TypeID("SNam"): case TypeID("(c) "): case TypeID("AUTH"):
+        case TypeID("RelN"): case TypeID("Reso"): case TypeID("APal"):
+            blorb_data.chunks.emplace_back(chunktype, std::move(chunk));
+            break;
+        case TypeID("PNG "): case TypeID("Rect"): {
+            try {
+                auto id = ids.at(pos);
+                blorb_data.picts.emplace(id, Chunk{chunktype, std::move(chunk)});
+            } catch (const std::out_of_range &) {
+                throw Error(std::format("found {:08x} ({}) chunk at offset {:x}, but no RIdx entries reference it", chunktype, idstr(chunktype), pos));
+            }
+            break;
+        }
+        case TypeID("ZCOD"):
+            if (pos != exec_offset) {
+                throw Error(std::format("unknown chunk: {:08x} ({}) @{:x}", chunktype, idstr(chunktype), pos));
+            }
+            blorb_data.exec.emplace(data.begin(), data.end());
+            break;
+        case TypeID("BPal"):
+            if (!generated) {
+                throw Error("this file already has a BPal chunk");
+            }
+            if (size % 12 != 0) {
+                throw Error(std::format("invalid BPal size: {}", size));
+            }
+            for (std::size_t i = 0; i < size; i += 12) {
+                blorb_data.bpal.emplace_back(be32(data[i + 0], data[i + 1], data[i +  2], data[i +  3]),
+                                             be32(data[i + 4], data[i + 5], data[i +  6], data[i +  7]),
+                                             be32(data[i + 8], data[i + 9], data[i + 10], data[i + 11]));
+            }
+            break;
+        case TypeID("BPIx"): {
+            if (!generated) {
+                throw Error("this file already has a BPIx chunk");
+            }
+
+            // When there is also a BPal chunk, it lists the same entries.
+            try {
+                bpix::Table table(data);
+                matrix.clear();
+                for (const auto palette : table.palettes()) {
+                    for (const auto apal_id : table.apal()) {
+                        if (auto id = table.lookup(palette, apal_id); id != 0) {
+                            matrix.emplace_back(palette, apal_id, id);
+                        }
+                    }
+                }
+            } catch (const bpix::Error &e) {
+                throw Error(e.what());
+            }
+            break;
+        }
+        case TypeID("BPlt"):
+            if (!generated) {
+                throw Error("this file already has a BPlt chunk");
+            }
+            try {
+                blorb_data.bplt = bplt::parse(data);
+            } catch (const bplt::Error &e) {
+                throw Error(e.what());
+            }
+            break;
+        case TypeID("BPsc"):
+            if (!generated) {
+                throw Error("this file already has a BPsc chunk");
+            }
+            if (size % 16 != 0) {
+                throw Error(std::format("invalid BPsc size: {}", size));
+            }
+            for (std::size_t i = 0; i < size; i += 16) {
+                blorb_data.scaled.emplace_back(be32(data[i +  0], data[i +  1], data[i +  2], data[i +  3]),
+                                               be32(data[i +  4], data[i +  5], data[i +  6], data[i +  7]),
+                                               be32(data[i +  8], data[i +  9], data[i + 10], data[i + 11]),
+                                               be32(data[i + 12], data[i + 13], data[i + 14], data[i + 15]));
+            }
+            break;
+        default:
+            throw Error(std::format("unknown chunk: {:08x} ({}) @{:x}", chunktype, idstr(chunktype), pos));
+        }
+    }
+
+    if (!matrix.empty()) {
+        blorb_data.table_format = blorb_data.bpal.empty() ? TableFormat::matrix : TableFormat::both;
+        if (blorb_data.bpal.empty()) {
+            blorb_data.bpal = std::move(matrix);
+        }
+    }
+
+    BPAL_PROBE2(parse__done, blorb.size(), blorb_data.picts.size());
+
+    return blorb_data;
+}
+
+Plan plan(const BlorbData &blorb_data)
+{
+    Plan plan;
+
+    plan.apal = find_apal_images(blorb_data.chunks);
+    for (const auto apal_id : plan.apal) {
+        if (!blorb_data.picts.contains(apal_id)) {
+            throw Error(std::format("APal references image {}, which does not exist", apal_id));
+        }
+    }
+
+    if (plan.apal.empty()) {
+        throw Error("no APal images found");
+    }
+
+    for (const auto &[id, chunk] : blorb_data.picts) {
+        if (chunk.type == TypeID("PNG ") && !plan.apal.contains(id)) {
+            plan.palettes.push_back(id);
+        }
+    }
+
+    plan.pairs.reserve(plan.palettes.size() * plan.apal.size());
+    for (const auto palette : plan.palettes) {
+        for (const auto apal_id : plan.apal) {
+            plan.pairs.emplace_back(palette, apal_id);
+        }
+    }
+
+    return plan;
+}
+
+DrawTrace parse_draw_trace(std::string_view text)
+{
+    DrawTrace trace;
+
+    while (!text.empty()) {
+        auto c = text.front();
+
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            text.remove_prefix(1);
+        } else if (c == '#') {
+            auto eol = text.find('\n');
+            text.remove_prefix(eol == text.npos ? text.size() : eol);
+        } else {
+            std::uint32_t id;
+            auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), id);
+            if (ec != std::errc() || (ptr != text.data() + text.size() && !std::isspace(static_cast<unsigned char>(*ptr)) && *ptr != '#')) {
+                throw Error(std::format("invalid picture number in trace: {}", text.substr(0, text.find_first_of(" \t\r\n"))));
+            }
+
+            trace.push_back(id);
+            text.remove_prefix(ptr - text.data());
+        }
+    }
+
+    return trace;
+}
+
+void restrict_to_traces(Plan &plan, std::span<const DrawTrace> traces)
+{
+    FlatSet<std::pair<std::uint32_t, std::uint32_t>> reached;
+    FlatSet<std::uint32_t> reached_palettes;
+
+    for (const auto &trace : traces) {
+        std::optional<std::uint32_t> current;
+
+        for (const auto id : trace) {
+            if (plan.apal.contains(id)) {
+                if (current.has_value()) {
+                    reached.insert({*current, id});
+                    reached_palettes.insert(*current);
+                }
+            } else if (std::ranges::binary_search(plan.palettes, id)) {
+                current = id;
+            }
+        }
+    }
+
+    std::erase_if(plan.pairs, [&reached](const auto &pair) { return !reached.contains(pair); });
+    std::erase_if(plan.palettes, [&reached_palettes](auto palette) { return !reached_palettes.contains(palette); });
+}
+
+DrawablePictures drawable_pictures(std::span<const unsigned char> story)
+{
+    if (story.size() < 64 || story[0] != 6) {
+        return {std::nullopt, "the story is not for version 6"};
+    }
+
+    // Every draw_picture instruction is encoded as 0xbe 0x05 (EXT:5),
+    // followed by the operand types, so scanning for these bytes finds
+    // them all, along with some which are really data. draw_picture has
+    // one to three operands, the first being the picture number, and
+    // omitted operands (type 0b11) can only be followed by others, so a
+    // types byte of any other form cannot be a real instruction.
+    std::size_t high_memory = (story[4] << 8) | story[5];
+    FlatSet<std::uint32_t> pictures;
+    std::size_t variable = 0;
+    std::size_t first_variable = 0;
+
+    auto valid_types = [](unsigned char types) {
+        bool omitted = false;
+        for (int shift = 6; shift >= 0; shift -= 2) {
+            auto type = (types >> shift) & 0b11;
+            if (omitted && type != 0b11) {
+                return false;
+            }
+            omitted = type == 0b11;
+        }
+        return (types >> 6) != 0b11 && omitted;
+    };
+
+    for (auto i = high_memory; i + 2 < story.size(); i++) {
+        if (story[i] != 0xbe || story[i + 1] != 0x05 || !valid_types(story[i + 2])) {
+            continue;
+        }
+
+        switch (story[i + 2] >> 6) {
+        case 0b00:
+            if (i + 4 < story.size()) {
+                pictures.insert((story[i + 3] << 8) | story[i + 4]);
+            }
+            break;
+        case 0b01:
+            if (i + 3 < story.size()) {
+                pictures.insert(story[i + 3]);
+            }
+            break;
+        case 0b10:
+            if (variable++ == 0) {
+                first_variable = i;
+            }
+            break;
+        }
+    }
+
+    if (variable != 0) {
+        return {std::nullopt, std::format("the draw_picture at {:#x} takes the picture from a variable ({} such in all)", first_variable, variable)};
+    }
+
+    return {std::move(pictures), {}};
+}
+
+void restrict_to_pictures(Plan &plan, const FlatSet<std::uint32_t> &pictures)
+{
+    std::erase_if(plan.pairs, [&pictures](const auto &pair) {
+        return !pictures.contains(pair.first) || !pictures.contains(pair.second);
+    });
+    std::erase_if(plan.palettes, [&pictures](auto palette) { return !pictures.contains(palette); });
+}
+
+namespace {
+
+// A color in CIE L*a*b* (D65), where distances approximate perceived
+// differences. Alpha is kept apart: colors with different alpha are never
+// considered alike.
+struct Lab {
+    double l;
+    double a;
+    double b;
+    int alpha;
+};
+
+Lab lab(QRgb rgb)
+{
+    auto linear = [](int c) {
+        double v = c / 255.0;
+        return v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4);
+    };
+
+    auto r = linear(qRed(rgb));
+    auto g = linear(qGreen(rgb));
+    auto b = linear(qBlue(rgb));
+
+    auto f = [](double t) {
+        return t > 216.0 / 24389.0 ? std::cbrt(t) : (24389.0 / 27.0 * t + 16.0) / 116.0;
+    };
+
+    auto x = f((0.4124 * r + 0.3576 * g + 0.1805 * b) / 0.95047);
+    auto y = f((0.2126 * r + 0.7152 * g + 0.0722 * b) / 1.00000);
+    auto z = f((0.0193 * r + 0.1192 * g + 0.9505 * b) / 1.08883);
+
+    return {116.0 * y - 16.0, 500.0 * (x - y), 200.0 * (y - z), qAlpha(rgb)};
+}
+
+double delta_e(const Lab &x, const Lab &y)
+{
+    if (x.alpha != y.alpha) {
+        return std::numeric_limits<double>::infinity();
+    }
+
+    return std::sqrt((x.l - y.l) * (x.l - y.l) + (x.a - y.a) * (x.a - y.a) + (x.b - y.b) * (x.b - y.b));
+}
+
+std::size_t chunk_size(std::size_t size)
+{
+    return 8 + size + (size & 1);
+}
+
+// The size of the output for “blorb_data” with “pairs” BPal entries,
+// but without the replacements themselves, as serialize() would write
+// it.
+std::size_t base_size(const BlorbData &blorb_data, std::size_t pairs)
+{
+    std::size_t size = 12 + chunk_size(4 + 12 * blorb_data.picts.size() + (blorb_data.exec.has_value() ? 12 : 0)) + chunk_size(12 * pairs);
+    for (const auto &chunk : blorb_data.chunks) {
+        size += chunk_size(chunk.data.size());
+    }
+    for (const auto &[id, chunk] : blorb_data.picts) {
+        size += chunk_size(chunk.data.size());
+    }
+    if (blorb_data.exec.has_value()) {
+        size += chunk_size(blorb_data.exec->size());
+    }
+
+    return size;
+}
+
+}
+
+ClusterReport cluster_palettes(Plan &plan, const BlorbData &blorb_data, Context &context, const ClusterOptions &options)
+{
+    context.status("Clustering palettes...");
+
+    std::vector<std::vector<Lab>> palettes(plan.palettes.size());
+    context.pool().parallel_for(palettes.size(), [&](std::size_t i) {
+        const auto &data = blorb_data.picts.at(plan.palettes[i]).data;
+        for (const auto color : *decoded_palette(context, plan.palettes[i], digest(data), data)) {
+            palettes[i].push_back(lab(color));
+        }
+    });
+
+    auto palette_index = [&plan](std::uint32_t palette) -> std::size_t {
+        return std::ranges::lower_bound(plan.palettes, palette) - plan.palettes.begin();
+    };
+
+    // For each APal image: its pairs, the color entries its pixels use
+    // (other than the first two, which are never replaced), and its own
+    // colors, which remain for entries past the end of a palette.
+    struct Column {
+        std::vector<std::size_t> pairs;
+        std::vector<int> used;
+        std::vector<Lab> own;
+        std::size_t size;
+    };
+
+    std::vector<Column> columns(plan.apal.size());
+    for (const auto &[i, pair] : std::views::enumerate(plan.pairs)) {
+        columns[std::ranges::lower_bound(plan.apal, pair.second) - plan.apal.begin()].pairs.push_back(i);
+    }
+
+    context.pool().parallel_for(columns.size(), [&](std::size_t c) {
+        auto &column = columns[c];
+        const auto &data = blorb_data.picts.at(*(plan.apal.begin() + c)).data;
+        column.size = data.size();
+
+        if (column.pairs.empty()) {
+            return;
+        }
+
+        auto image = decoded_apal(context, *(plan.apal.begin() + c), digest(data), data);
+        if (image.format() != QImage::Format_Indexed8) {
+            return;
+        }
+
+        std::array<bool, 256> seen{};
+        for (int y = 0; y < image.height(); y++) {
+            const auto *line = image.constScanLine(y);
+            for (int x = 0; x < image.width(); x++) {
+                seen[line[x]] = true;
+            }
+        }
+
+        for (const auto color : image.colorTable()) {
+            column.own.push_back(lab(color));
+        }
+
+        for (int i = 2; i < static_cast<int>(column.own.size()); i++) {
+            if (seen[i]) {
+                column.used.push_back(i);
+            }
+        }
+    });
+
+    // Everything but the replacements, and their RIdx entries.
+    auto base = base_size(blorb_data, plan.pairs.size());
+
+    struct Result {
+        std::vector<std::uint32_t> sources;
+        std::size_t replacements = 0;
+        double max_error = 0;
+        std::size_t estimated_size = 0;
+    };
+
+    auto cluster = [&](double threshold) {
+        Result result;
+        result.sources.resize(plan.pairs.size());
+        std::vector<Result> column_results(columns.size());
+
+        context.pool().parallel_for(columns.size(), [&](std::size_t c) {
+            const auto &column = columns[c];
+            auto &column_result = column_results[c];
+            std::vector<std::size_t> leaders;
+
+            auto color = [&column](const std::vector<Lab> &palette, int i) -> const Lab & {
+                return i < static_cast<int>(palette.size()) ? palette[i] : column.own[i];
+            };
+
+            for (const auto pair : column.pairs) {
+                const auto &palette = palettes[palette_index(plan.pairs[pair].first)];
+                std::optional<std::size_t> joined;
+                double error = 0;
+
+                for (const auto leader : leaders) {
+                    const auto &leader_palette = palettes[palette_index(plan.pairs[leader].first)];
+                    double distance = 0;
+
+                    for (const auto i : column.used) {
+                        distance = std::max(distance, delta_e(color(palette, i), color(leader_palette, i)));
+                        if (distance > threshold) {
+                            break;
+                        }
+                    }
+
+                    if (distance <= threshold) {
+                        joined = leader;
+                        error = distance;
+                        break;
+                    }
+                }
+
+                if (!joined.has_value()) {
+                    leaders.push_back(pair);
+                    joined = pair;
+                    column_result.estimated_size += 12 + chunk_size(column.size);
+                }
+
+                result.sources[pair] = plan.pairs[*joined].first;
+                column_result.max_error = std::max(column_result.max_error, error);
+            }
+
+            column_result.replacements = leaders.size();
+        });
+
+        result.estimated_size = base;
+        for (const auto &column_result : column_results) {
+            result.replacements += column_result.replacements;
+            result.max_error = std::max(result.max_error, column_result.max_error);
+            result.estimated_size += column_result.estimated_size;
+        }
+
+        return result;
+    };
+
+    auto threshold = options.threshold;
+    auto result = cluster(threshold);
+
+    // The number of replacements shrinks as the threshold grows, so
+    // search for the smallest threshold which meets the target. Beyond a
+    // ΔE of 400, every pair of colors with equal alpha is alike.
+    if (options.target_size.has_value() && result.estimated_size > *options.target_size) {
+        double low = threshold;
+        double high = 400;
+        auto best = cluster(high);
+        threshold = high;
+
+        if (best.estimated_size <= *options.target_size) {
+            for (int i = 0; i < 32; i++) {
+                auto middle = (low + high) / 2;
+                auto attempt = cluster(middle);
+
+                if (attempt.estimated_size <= *options.target_size) {
+                    high = middle;
+                    best = std::move(attempt);
+                } else {
+                    low = middle;
+                }
+            }
+
+            threshold = high;
+        }
+
+        result = std::move(best);
+    }
+
+    plan.sources = std::move(result.sources);
+
+    auto target_met = !options.target_size.has_value() || result.estimated_size <= *options.target_size;
+    if (!target_met) {
+        context.status(std::format("Unable to fit the output in {} bytes; the smallest estimated size is {} bytes",
+                    *options.target_size, result.estimated_size));
+    }
+
+    return {threshold, plan.pairs.size(), result.replacements, result.max_error, result.estimated_size, target_met};
+}
+
+void reuse(Plan &plan, Context &context, const BlorbData &previous, const IncrementalState &state)
+{
+    FlatMap<std::uint32_t, Digest> inputs;
+    for (const auto &input : state.inputs) {
+        inputs.emplace(input.id, input.digest);
+    }
+
+    // Seeding the Context’s caches is all that is needed for conversion
+    // and compression to skip unchanged pairs.
+    std::unordered_map<std::uint32_t, Digest> usable;
+    for (const auto &replacement : state.replacements) {
+        auto it = previous.picts.find(replacement.id);
+        if (it == previous.picts.end() || digest(it->second.data) != replacement.compressed) {
+            continue;
+        }
+
+        const auto &data = it->second.data;
+        if (context.compressed().emplace(replacement.converted, std::make_shared<const std::vector<unsigned char>>(data.begin(), data.end())).second) {
+            account(context, Statistics::Memory::compressed, data.size());
+            account(context, Statistics::Memory::keys, sizeof(Digest));
+        }
+        plan.preferred_ids.emplace(replacement.converted, replacement.id);
+        usable.emplace(replacement.id, replacement.converted);
+    }
+
+    for (const auto &pair : state.pairs) {
+        auto converted = usable.find(pair.id);
+        auto palette = inputs.find(pair.palette);
+        auto apal = inputs.find(pair.requested);
+
+        if (converted != usable.end() && palette != inputs.end() && apal != inputs.end()) {
+            if (context.replacements().emplace(combine(apal->second, palette->second), converted->second).second) {
+                account(context, Statistics::Memory::keys, 2 * sizeof(Digest));
+            }
+        }
+    }
+}
+
+Conversion convert(const BlorbData &blorb_data, const Plan &plan, Context &context)
+{
+    context.status("Converting images...");
+    StageTimer timer(context, Statistics::Stage::convert);
+
+    Conversion conversion;
+
+    // APal images are decoded (or fetched from the Context) on first
+    // use, so that an image whose replacements are all cached is never
+    // touched.
+    struct APalImage {
+        Digest digest;
+        std::once_flag decoded;
+        QImage image;
+    };
+
+    std::vector<APalImage> apal_images(plan.apal.size());
+    auto apal_index = [&plan](std::uint32_t apal_id) -> std::size_t {
+        return std::ranges::lower_bound(plan.apal, apal_id) - plan.apal.begin();
+    };
+
+    context.pool().parallel_for(apal_images.size(), [&](std::size_t i) {
+        apal_images[i].digest = digest(blorb_data.picts.at(*(plan.apal.begin() + i)).data);
+    });
+
+    // Each task converts all pairs for one current palette image, so
+    // that image is decoded at most once.
+    std::vector<std::pair<std::size_t, std::size_t>> rows;
+    for (std::size_t i = 0; i < plan.pairs.size(); ) {
+        auto end = i + 1;
+        while (end < plan.pairs.size() && plan.pairs[end].first == plan.pairs[i].first) {
+            end++;
+        }
+
+        rows.emplace_back(i, end);
+        i = end;
+    }
+
+    // Images are deduplicated by digest as they are converted, so only
+    // unique ones are kept. Each remembers the first pair which produced
+    // it, so that IDs can be assigned in pair order afterwards, making
+    // the output independent of thread scheduling.
+    struct Unique {
+        std::span<const unsigned char> data;
+        Digest digest;
+        std::size_t first_pair;
+    };
+
+    std::mutex mutex;
+    std::vector<Unique> uniques;
+    std::unordered_map<Digest, std::size_t, DigestHash> by_digest;
+    std::vector<std::size_t> pair_unique(plan.pairs.size());
+
+    conversion.sources = plan.sources;
+    if (conversion.sources.empty()) {
+        for (const auto &pair : plan.pairs) {
+            conversion.sources.push_back(pair.first);
+        }
+    }
+
+    context.pool().parallel_for(rows.size(), [&](std::size_t row) {
+        auto [begin, end] = rows[row];
+        std::optional<std::uint32_t> source;
+        Digest palette_digest;
+        std::shared_ptr<const QList<QRgb>> palette;
+        QByteArray scratch;
+
+        for (auto i = begin; i < end; i++) {
+            // Colors normally come from the row’s own current palette,
+            // but clustering can substitute another one.
+            if (conversion.sources[i] != source) {
+                source = conversion.sources[i];
+                palette_digest = digest(blorb_data.picts.at(*source).data);
+                palette = nullptr;
+            }
+
+            auto &apal = apal_images[apal_index(plan.pairs[i].second)];
+            auto key = combine(apal.digest, palette_digest);
+            std::span<const unsigned char> converted;
+
+            // A cached replacement is only useful if its compressed form
+            // is also still cached, as its data is not kept.
+            Trace::Pictures pictures{plan.pairs[i].second, *source};
+            auto converted_digest = [&] {
+                TraceScope scope(context.trace(), "cache lookup", pictures);
+                auto found = context.replacements().find(key);
+                return found.has_value() && context.compressed().find(*found).has_value() ? found : std::nullopt;
+            }();
+
+            if (!converted_digest.has_value()) {
+                if (palette == nullptr) {
+                    palette = decoded_palette(context, *source, palette_digest, blorb_data.picts.at(*source).data);
+                }
+
+                std::call_once(apal.decoded, [&] {
+                    apal.image = decoded_apal(context, plan.pairs[i].second, apal.digest, blorb_data.picts.at(plan.pairs[i].second).data);
+                });
+
+                TraceScope scope(context.trace(), "convert_palette", pictures);
+                BPAL_PROBE2(convert__start, plan.pairs[i].second, *source);
+                converted = convert_palette(apal.image, *palette, scratch);
+                BPAL_PROBE3(convert__done, plan.pairs[i].second, *source, converted.size());
+                auto [cached_digest, inserted] = context.replacements().emplace(key, digest(converted));
+                if (inserted) {
+                    account(context, Statistics::Memory::keys, 2 * sizeof(Digest));
+                }
+                converted_digest = cached_digest;
+            }
+
+            // This includes waiting for the lock, which all threads share.
+            StageTimer dedup_timer(context, Statistics::Stage::dedup, StageTimer::Scope::thread);
+            BPAL_PROBE2(dedup__start, plan.pairs[i].second, *source);
+            std::lock_guard lock(mutex);
+            auto [it, inserted] = by_digest.try_emplace(*converted_digest, uniques.size());
+
+            if (inserted) {
+                auto stored = static_cast<unsigned char *>(conversion.arena->allocate(converted.size(), 1));
+                std::ranges::copy(converted, stored);
+                uniques.emplace_back(std::span<const unsigned char>(stored, converted.size()), *converted_digest, i);
+            } else {
+                auto &unique = uniques[it->second];
+                unique.first_pair = std::min(unique.first_pair, i);
+
+                // A cache hit leaves no data; if this pair had to be
+                // converted anyway, hold on to its data in case the
+                // compressed cache is cleared before compression.
+                if (unique.data.empty() && !converted.empty()) {
+                    auto stored = static_cast<unsigned char *>(conversion.arena->allocate(converted.size(), 1));
+                    std::ranges::copy(converted, stored);
+                    unique.data = std::span<const unsigned char>(stored, converted.size());
+                }
+            }
+
+            pair_unique[i] = it->second;
+            BPAL_PROBE3(dedup__done, plan.pairs[i].second, *source, inserted);
+        }
+    });
+
+    // Images from an earlier run keep their IDs, as long as these are
+    // still free; the rest are numbered in pair order, after every ID in
+    // use.
+    std::vector<std::optional<std::uint32_t>> kept(uniques.size());
+    FlatSet<std::uint32_t> kept_ids;
+    auto next_id = blorb_data.next_id;
+
+    for (const auto &[u, unique] : std::views::enumerate(uniques)) {
+        auto it = plan.preferred_ids.find(unique.digest);
+        if (it != plan.preferred_ids.end() && !blorb_data.picts.contains(it->second) && kept_ids.insert(it->second).second) {
+            kept[u] = it->second;
+            next_id = std::max(next_id, it->second + 1);
+        }
+    }
+
+    std::vector<std::size_t> order(uniques.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::ranges::sort(order, {}, [&uniques](auto u) { return uniques[u].first_pair; });
+
+    std::vector<std::uint32_t> ids(uniques.size());
+    for (const auto u : order) {
+        ids[u] = kept[u].has_value() ? *kept[u] : next_id++;
+    }
+
+    std::ranges::sort(order, {}, [&ids](auto u) { return ids[u]; });
+    for (const auto u : order) {
+        conversion.ids.push_back(ids[u]);
+        conversion.images.push_back(uniques[u].data);
+        conversion.digests.push_back(uniques[u].digest);
+    }
+
+    conversion.bpal.reserve(plan.pairs.size());
+    for (const auto &[i, pair] : std::views::enumerate(plan.pairs)) {
+        conversion.bpal.emplace_back(pair.first, pair.second, ids[pair_unique[i]]);
+    }
+
+    if (auto *statistics = context.statistics()) {
+        statistics->add_dedup(plan.pairs.size(), uniques.size());
+    }
+
+    return conversion;
+}
+
+std::vector<bplt::Entry> palette_entries(const BlorbData &blorb_data, const Plan &plan, Context &context)
+{
+    context.status("Collecting palettes...");
+
+    // Only the number of colors in each APal image is needed, as that is
+    // where substitution stops.
+    std::vector<std::size_t> apal_colors(plan.apal.size());
+    context.pool().parallel_for(apal_colors.size(), [&](std::size_t i) {
+        auto apal_id = *(plan.apal.begin() + i);
+        const auto &data = blorb_data.picts.at(apal_id).data;
+        apal_colors[i] = decoded_apal(context, apal_id, digest(data), data).colorTable().size();
+    });
+
+    std::vector<bplt::Entry> entries(plan.pairs.size());
+    context.pool().parallel_for(entries.size(), [&](std::size_t i) {
+        auto [palette, apal_id] = plan.pairs[i];
+        auto source = plan.sources.empty() ? palette : plan.sources[i];
+        const auto &data = blorb_data.picts.at(source).data;
+        auto colors = decoded_palette(context, source, digest(data), data);
+        auto count = std::min<std::size_t>(colors->size(), apal_colors[std::ranges::lower_bound(plan.apal, apal_id) - plan.apal.begin()]);
+
+        auto &entry = entries[i];
+        entry.current = palette;
+        entry.requested = apal_id;
+        entry.first = 2;
+        for (std::size_t j = entry.first; j < count; j++) {
+            auto color = (*colors)[j];
+            entry.colors.emplace_back(qRed(color), qGreen(color), qBlue(color), qAlpha(color));
+        }
+    });
+
+    return entries;
+}
+
+void compress(BlorbData &blorb_data, const Conversion &conversion, Context &context)
+{
+    context.status("Compressing images...");
+    StageTimer timer(context, Statistics::Stage::compress);
+
+    std::vector<ContentCache::value_type> compressed(conversion.images.size());
+
+    const auto &report = context.options().progress;
+    std::mutex progress_mutex;
+    Progress progress;
+    if (report) {
+        progress.total_images = conversion.images.size();
+        progress.total_bytes = conversion_bytes(conversion);
+        report(progress);
+    }
+
+    context.pool().parallel_for(conversion.images.size(), [&](std::size_t i) {
+        auto &cache = context.compressed();
+
+        auto cached = [&] {
+            TraceScope scope(context.trace(), "cache lookup", {conversion.ids[i]});
+            return cache.find(conversion.digests[i]);
+        }();
+
+        if (cached.has_value()) {
+            compressed[i] = *cached;
+        } else if (conversion.images[i].empty()) {
+            throw Error(std::format("image {} was evicted from the cache before it could be compressed", conversion.ids[i]));
+        } else {
+            auto start = std::chrono::steady_clock::now();
+            auto png = [&] {
+                TraceScope scope(context.trace(), "compress_png", {conversion.ids[i]});
+                BPAL_PROBE2(compress__start, conversion.ids[i], conversion.images[i].size());
+                auto png = compress_png(conversion.images[i]);
+                BPAL_PROBE3(compress__done, conversion.ids[i], conversion.images[i].size(), png.size());
+                return png;
+            }();
+            bool inserted;
+            std::tie(compressed[i], inserted) = cache.emplace(conversion.digests[i], std::make_shared<const std::vector<unsigned char>>(std::move(png)));
+            if (inserted) {
+                account(context, Statistics::Memory::compressed, compressed[i]->size());
+                account(context, Statistics::Memory::keys, sizeof(Digest));
+            }
+
+            if (auto *statistics = context.statistics()) {
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                statistics->add_compressed(conversion.images[i].size(), compressed[i]->size(), elapsed.count());
+            }
+        }
+
+        if (report) {
+            std::lock_guard lock(progress_mutex);
+            progress.images++;
+            progress.bytes += conversion.images[i].size();
+            if (!conversion.images[i].empty()) {
+                progress.saved += static_cast<std::ptrdiff_t>(conversion.images[i].size()) - static_cast<std::ptrdiff_t>(compressed[i]->size());
+            }
+            report(progress);
+        }
+    });
+
+    // The arena is not thread-safe, so compressed images are copied into
+    // it once all are done.
+    blorb_data.picts.reserve(blorb_data.picts.size() + compressed.size());
+    for (const auto &[i, png] : std::views::enumerate(compressed)) {
+        blorb_data.picts.emplace(conversion.ids[i], Chunk{TypeID("PNG "), Bytes(png->begin(), png->end(), blorb_data.arena.get())});
+    }
+
+    if (!conversion.ids.empty()) {
+        blorb_data.next_id = std::max(blorb_data.next_id, conversion.ids.back() + 1);
+    }
+    blorb_data.bpal.insert(blorb_data.bpal.end(), conversion.bpal.begin(), conversion.bpal.end());
+    blorb_data.scaled.insert(blorb_data.scaled.end(), conversion.scaled.begin(), conversion.scaled.end());
+}
+
+double Resolution::ratio(std::uint32_t id, WindowSize window) const
+{
+    auto it = entries.find(id);
+    if (it == entries.end()) {
+        return 1;
+    }
+
+    // Zero limits mean no limit.
+    auto clamp = [](std::uint32_t n, std::uint32_t lo, std::uint32_t hi) {
+        if (lo != 0) {
+            n = std::max(n, lo);
+        }
+        if (hi != 0) {
+            n = std::min(n, hi);
+        }
+        return n;
+    };
+
+    auto value = [](Ratio ratio) {
+        return ratio.denominator == 0 ? 0.0 : static_cast<double>(ratio.numerator) / ratio.denominator;
+    };
+
+    auto width = clamp(window.width, min.width, max.width);
+    auto height = clamp(window.height, min.height, max.height);
+    auto erf = std::min(static_cast<double>(width) / standard.width, static_cast<double>(height) / standard.height);
+
+    const auto &entry = it->second;
+    auto r = erf * value(entry.standard);
+    if (value(entry.min) != 0) {
+        r = std::max(r, value(entry.min));
+    }
+    if (value(entry.max) != 0) {
+        r = std::min(r, value(entry.max));
+    }
+
+    return r;
+}
+
+Resolution parse_resolution(std::span<const unsigned char> chunk)
+{
+    if (chunk.size() < 24 || (chunk.size() - 24) % 28 != 0) {
+        throw Error(std::format("invalid Reso size: {}", chunk.size()));
+    }
+
+    auto read32 = [&chunk](std::size_t offset) {
+        return be32(chunk[offset], chunk[offset + 1], chunk[offset + 2], chunk[offset + 3]);
+    };
+
+    Resolution resolution;
+    resolution.standard = {read32(0), read32(4)};
+    resolution.min = {read32(8), read32(12)};
+    resolution.max = {read32(16), read32(20)};
+
+    if (resolution.standard.width == 0 || resolution.standard.height == 0) {
+        throw Error("Reso chunk has no standard window size");
+    }
+
+    for (std::size_t offset = 24; offset < chunk.size(); offset += 28) {
+        resolution.entries.emplace(read32(offset), Resolution::Entry{
+            {read32(offset +  4), read32(offset +  8)},
+            {read32(offset + 12), read32(offset + 16)},
+            {read32(offset + 20), read32(offset + 24)},
+        });
+    }
+
+    return resolution;
+}
+
+// The dimensions from a PNG image’s header.
+static std::pair<std::uint32_t, std::uint32_t> png_size(std::span<const unsigned char> png)
+{
+    if (png.size() < 24) {
+        throw Error("truncated PNG");
+    }
+
+    return {be32(png[16], png[17], png[18], png[19]), be32(png[20], png[21], png[22], png[23])};
+}
+
+Conversion scale(const BlorbData &blorb_data, std::span<const WindowSize> windows, Context &context)
+{
+    Conversion conversion;
+
+    if (windows.empty() || blorb_data.bpal.empty()) {
+        return conversion;
+    }
+
+    auto reso = std::ranges::find(blorb_data.chunks, TypeID("Reso"), &Chunk::type);
+    if (reso == blorb_data.chunks.end()) {
+        throw Error("cannot pre-scale replacements without a Reso chunk");
+    }
+
+    auto resolution = parse_resolution(reso->data);
+
+    context.status("Scaling images...");
+
+    struct Task {
+        std::uint32_t replacement;
+        std::uint32_t width;
+        std::uint32_t height;
+    };
+
+    // Replacements which scale to the same size in several windows are
+    // only scaled once.
+    std::vector<Task> tasks;
+    FlatMap<std::tuple<std::uint32_t, std::uint32_t, std::uint32_t>, std::size_t> by_size;
+
+    for (const auto &window : windows) {
+        // A replacement shared by several BPal entries scales to the size
+        // given by the Reso entry of each APal image it replaces. A BPsc
+        // entry is keyed by replacement alone, so one is written only if
+        // all of those sizes agree; otherwise the replacement is left
+        // out, and scaled at plot time as usual.
+        struct Size {
+            std::uint32_t width;
+            std::uint32_t height;
+            std::uint32_t scaled_width;
+            std::uint32_t scaled_height;
+            bool agreed;
+        };
+        FlatMap<std::uint32_t, Size> sizes;
+
+        for (const auto &entry : blorb_data.bpal) {
+            auto replacement = blorb_data.picts.find(entry.id);
+            if (replacement == blorb_data.picts.end() || replacement->second.type != TypeID("PNG ")) {
+                continue;
+            }
+
+            auto [width, height] = png_size(replacement->second.data);
+            auto ratio = resolution.ratio(entry.requested, window);
+            auto scaled_width = std::max<std::uint32_t>(1, std::lround(width * ratio));
+            auto scaled_height = std::max<std::uint32_t>(1, std::lround(height * ratio));
+
+            auto [it, inserted] = sizes.emplace(entry.id, width, height, scaled_width, scaled_height, true);
+            if (!inserted && (it->second.scaled_width != scaled_width || it->second.scaled_height != scaled_height)) {
+                it->second.agreed = false;
+            }
+        }
+
+        for (const auto &[id, size] : sizes) {
+            if (!size.agreed || (size.scaled_width == size.width && size.scaled_height == size.height)) {
+                continue;
+            }
+
+            auto [it, inserted] = by_size.emplace(std::tuple(id, size.scaled_width, size.scaled_height), tasks.size());
+            if (inserted) {
+                tasks.emplace_back(id, size.scaled_width, size.scaled_height);
+            }
+
+            // The task index stands in for the ID until all are known.
+            conversion.scaled.emplace_back(window.width, window.height, id, it->second);
+        }
+    }
+
+    conversion.images.resize(tasks.size());
+    conversion.digests.resize(tasks.size());
+
+    std::mutex mutex;
+
+    context.pool().parallel_for(tasks.size(), [&](std::size_t i) {
+        const auto &task = tasks[i];
+        const auto &source = blorb_data.picts.at(task.replacement).data;
+        std::array<unsigned char, 8> size;
+        for (int b = 0; b < 4; b++) {
+            size[b] = task.width >> (b * 8);
+            size[4 + b] = task.height >> (b * 8);
+        }
+        auto key = combine(digest(source), digest(size));
+
+        // As in convert(), cached images leave no data.
+        auto scaled_digest = [&] {
+            TraceScope scope(context.trace(), "cache lookup", {task.replacement});
+            auto found = context.replacements().find(key);
+            return found.has_value() && context.compressed().find(*found).has_value() ? found : std::nullopt;
+        }();
+
+        if (scaled_digest.has_value()) {
+            conversion.digests[i] = *scaled_digest;
+            return;
+        }
+
+        auto image = [&] {
+            StageTimer timer(context, Statistics::Stage::decode, StageTimer::Scope::thread, {task.replacement});
+            return decode_picture(task.replacement, source);
+        }();
+
+        // Integer factors keep pixel art sharp, and the image indexed.
+        TraceScope scope(context.trace(), "scale", {task.replacement});
+        auto exact = task.width % image.width() == 0 && task.height % image.height() == 0;
+        image = image.scaled(task.width, task.height, Qt::IgnoreAspectRatio, exact ? Qt::FastTransformation : Qt::SmoothTransformation);
+
+        QByteArray scratch;
+        auto png = save_png(image, scratch);
+        bool inserted;
+        std::tie(conversion.digests[i], inserted) = context.replacements().emplace(key, digest(png));
+        if (inserted) {
+            account(context, Statistics::Memory::keys, 2 * sizeof(Digest));
+        }
+
+        std::lock_guard lock(mutex);
+        auto stored = static_cast<unsigned char *>(conversion.arena->allocate(png.size(), 1));
+        std::ranges::copy(png, stored);
+        conversion.images[i] = std::span<const unsigned char>(stored, png.size());
+    });
+
+    for (std::size_t i = 0; i < tasks.size(); i++) {
+        conversion.ids.push_back(blorb_data.next_id + i);
+    }
+
+    for (auto &entry : conversion.scaled) {
+        entry.id = conversion.ids[entry.id];
+    }
+
+    return conversion;
+}
+
+IncrementalState incremental_state(const BlorbData &blorb_data, const Conversion &conversion)
+{
+    IncrementalState state;
+
+    // Replacements depend on the palette whose colors were applied,
+    // which is not the current palette if clustering substituted another.
+    FlatSet<std::uint32_t> inputs;
+    for (const auto &[i, entry] : std::views::enumerate(conversion.bpal)) {
+        inputs.insert(conversion.sources[i]);
+        inputs.insert(entry.requested);
+    }
+
+    for (const auto id : inputs) {
+        state.inputs.emplace_back(id, digest(blorb_data.picts.at(id).data));
+    }
+
+    for (std::size_t i = 0; i < conversion.ids.size(); i++) {
+        state.replacements.emplace_back(conversion.ids[i], conversion.digests[i], digest(blorb_data.picts.at(conversion.ids[i]).data));
+    }
+
+    for (const auto &[i, entry] : std::views::enumerate(conversion.bpal)) {
+        state.pairs.emplace_back(conversion.sources[i], entry.requested, entry.id);
+    }
+
+    return state;
+}
+
+static std::string hex(const Digest &digest)
+{
+    std::string s;
+
+    for (const auto byte : digest.bytes) {
+        s += std::format("{:02x}", byte);
+    }
+
+    return s;
+}
+
+static Digest unhex(std::string_view s)
+{
+    Digest digest;
+
+    if (s.size() != digest.bytes.size() * 2) {
+        throw Error(std::format("invalid digest: {}", s));
+    }
+
+    for (std::size_t i = 0; i < digest.bytes.size(); i++) {
+        if (std::from_chars(s.data() + (i * 2), s.data() + (i * 2) + 2, digest.bytes[i], 16).ptr != s.data() + (i * 2) + 2) {
+            throw Error(std::format("invalid digest: {}", s));
+        }
+    }
+
+    return digest;
+}
+
+// The incremental state is a line-based text format:
+//
+//     bpal-state 1
+//     input <id> <digest>
+//     replacement <id> <converted digest> <compressed digest>
+//     pair <palette applied> <APal image> <replacement id>
+std::string format_incremental_state(const IncrementalState &state)
+{
+    std::string text = "bpal-state 1\n";
+
+    for (const auto &input : state.inputs) {
+        text += std::format("input {} {}\n", input.id, hex(input.digest));
+    }
+
+    for (const auto &replacement : state.replacements) {
+        text += std::format("replacement {} {} {}\n", replacement.id, hex(replacement.converted), hex(replacement.compressed));
+    }
+
+    for (const auto &pair : state.pairs) {
+        text += std::format("pair {} {} {}\n", pair.palette, pair.requested, pair.id);
+    }
+
+    return text;
+}
+
+IncrementalState parse_incremental_state(std::string_view text)
+{
+    IncrementalState state;
+    bool header = false;
+
+    for (auto line_range : std::views::split(text, '\n')) {
+        std::string_view line(line_range.begin(), line_range.end());
+        std::vector<std::string_view> fields;
+        for (auto field : std::views::split(line, ' ')) {
+            if (!field.empty()) {
+                fields.emplace_back(field.begin(), field.end());
+            }
+        }
+
+        if (fields.empty()) {
+            continue;
+        }
+
+        auto number = [&line](std::string_view s) {
+            std::uint32_t n;
+            if (std::from_chars(s.data(), s.data() + s.size(), n).ptr != s.data() + s.size()) {
+                throw Error(std::format("invalid state line: {}", line));
+            }
+            return n;
+        };
+
+        if (!header) {
+            if (fields.size() != 2 || fields[0] != "bpal-state" || fields[1] != "1") {
+                throw Error("not a bpal state file");
+            }
+            header = true;
+        } else if (fields[0] == "input" && fields.size() == 3) {
+            state.inputs.emplace_back(number(fields[1]), unhex(fields[2]));
+        } else if (fields[0] == "replacement" && fields.size() == 4) {
+            state.replacements.emplace_back(number(fields[1]), unhex(fields[2]), unhex(fields[3]));
+        } else if (fields[0] == "pair" && fields.size() == 4) {
+            state.pairs.emplace_back(number(fields[1]), number(fields[2]), number(fields[3]));
+        } else {
+            throw Error(std::format("invalid state line: {}", line));
+        }
+    }
+
+    if (!header) {
+        throw Error("not a bpal state file");
+    }
+
+    return state;
+}
+
+std::vector<unsigned char> serialize(const BlorbData &blorb_data, Trace *trace)
+{
+    if (blorb_data.bpal.empty() && blorb_data.bplt.empty()) {
+        throw Error("BPal chunk is empty");
+    }
+
+    BPAL_PROBE1(write__start, blorb_data.chunks.size() + blorb_data.picts.size());
+
+    std::vector<unsigned char> out;
+
+    auto write32 = [&out](std::uint32_t n) {
+        out.push_back(n >> 24);
+        out.push_back((n >> 16) & 0xff);
+        out.push_back((n >>  8) & 0xff);
+        out.push_back(n & 0xff);
+    };
+
+    auto patch32 = [&out](std::size_t offset, std::uint32_t n) {
+        out[offset + 0] = n >> 24;
+        out[offset + 1] = (n >> 16) & 0xff;
+        out[offset + 2] = (n >>  8) & 0xff;
+        out[offset + 3] = n & 0xff;
+    };
+
+    auto write_chunk = [&out, &write32, trace](std::uint32_t type, std::span<const unsigned char> data, Trace::Pictures pictures = {}) {
+        TraceScope scope(trace, "write chunk", pictures);
+        write32(type);
+        write32(data.size());
+        out.insert(out.end(), data.begin(), data.end());
+        if (data.size() % 2 == 1) {
+            out.push_back(0);
+        }
+    };
+
+    std::size_t total = 0;
+    for (const auto &chunk : blorb_data.chunks) {
+        total += 8 + chunk.data.size() + 1;
+    }
+    for (const auto &[_, chunk] : blorb_data.picts) {
+        total += 12 + 8 + chunk.data.size() + 1;
+    }
+    if (blorb_data.exec.has_value()) {
+        total += 12 + 8 + blorb_data.exec->size() + 1;
+    }
+    out.reserve(24 + total + 8 + (blorb_data.bpal.size() * 12));
+
+    write32(TypeID("FORM"));
+    write32(0); // placeholder
+    write32(TypeID("IFRS"));
+    write32(TypeID("RIdx"));
+
+    std::uint32_t ridx_size = blorb_data.picts.size();
+    if (blorb_data.exec.has_value()) {
+        ridx_size++;
+    }
+    write32(4 + (ridx_size * 12));
+    write32(ridx_size);
+
+    for (const auto &[id, _] : blorb_data.picts) {
+        write32(TypeID("Pict"));
+        write32(id);
+        write32(0); // placeholder
+    }
+
+    if (blorb_data.exec.has_value()) {
+        write32(TypeID("Exec"));
+        write32(0);
+        write32(0);
+    }
+
+    auto write_tables = [&] {
+        if (!blorb_data.bpal.empty() && blorb_data.table_format != TableFormat::matrix) {
+            write32(TypeID("BPal"));
+            write32(blorb_data.bpal.size() * 4 * 3);
+
+            for (const auto &bpal_entry : blorb_data.bpal) {
+                write32(bpal_entry.palette);
+                write32(bpal_entry.requested);
+                write32(bpal_entry.id);
+            }
+        }
+
+        if (!blorb_data.bpal.empty() && blorb_data.table_format != TableFormat::list) {
+            FlatSet<std::uint32_t> palettes;
+            FlatSet<std::uint32_t> apal;
+            std::uint32_t max_id = 0;
+            for (const auto &entry : blorb_data.bpal) {
+                palettes.insert(entry.palette);
+                apal.insert(entry.requested);
+                max_id = std::max(max_id, entry.id);
+            }
+
+            std::uint32_t cell_size = max_id <= 0xffff ? 2 : 4;
+            std::vector<std::uint32_t> grid(palettes.size() * apal.size());
+            for (const auto &entry : blorb_data.bpal) {
+                auto row = std::ranges::lower_bound(palettes, entry.palette) - palettes.begin();
+                auto column = std::ranges::lower_bound(apal, entry.requested) - apal.begin();
+                grid[row * apal.size() + column] = entry.id;
+            }
+
+            std::size_t size = 12 + (palettes.size() + apal.size()) * 4 + grid.size() * cell_size;
+
+            write32(TypeID("BPIx"));
+            write32(size);
+            write32(palettes.size());
+            write32(apal.size());
+            write32(cell_size);
+            for (const auto palette : palettes) {
+                write32(palette);
+            }
+            for (const auto apal_id : apal) {
+                write32(apal_id);
+            }
+            for (const auto id : grid) {
+                if (cell_size == 2) {
+                    out.insert(out.end(), {static_cast<unsigned char>(id >> 8), static_cast<unsigned char>(id & 0xff)});
+                } else {
+                    write32(id);
+                }
+            }
+            if (size % 2 == 1) {
+                out.push_back(0);
+            }
+        }
+
+        if (!blorb_data.scaled.empty()) {
+            write32(TypeID("BPsc"));
+            write32(blorb_data.scaled.size() * 16);
+
+            for (const auto &entry : blorb_data.scaled) {
+                write32(entry.width);
+                write32(entry.height);
+                write32(entry.replacement);
+                write32(entry.id);
+            }
+        }
+
+        if (!blorb_data.bplt.empty()) {
+            std::size_t size = 0;
+            for (const auto &entry : blorb_data.bplt) {
+                size += 12 + entry.colors.size() * 4;
+            }
+
+            write32(TypeID("BPlt"));
+            write32(size);
+
+            for (const auto &entry : blorb_data.bplt) {
+                write32(entry.current);
+                write32(entry.requested);
+                write32((entry.first << 16) | entry.colors.size());
+                for (const auto &color : entry.colors) {
+                    out.insert(out.end(), {color.r, color.g, color.b, color.a});
+                }
+            }
+        }
+    };
+
+    // Chunks which an interpreter reads on startup go right after the
+    // resource index.
+    auto front = [&blorb_data](const Chunk &chunk) {
+        return blorb_data.layout == Layout::locality && (chunk.type == TypeID("Reso") || chunk.type == TypeID("APal"));
+    };
+
+    for (const auto &chunk : blorb_data.chunks) {
+        if (front(chunk)) {
+            write_chunk(chunk.type, chunk.data);
+        }
+    }
+
+    if (blorb_data.layout == Layout::locality) {
+        write_tables();
+    }
+
+    for (const auto &chunk : blorb_data.chunks) {
+        if (!front(chunk)) {
+            write_chunk(chunk.type, chunk.data);
+        }
+    }
+
+    // Offsets are in resource index order, which is always picture ID
+    // order, whatever order the pictures are written in.
+    FlatMap<std::uint32_t, std::size_t> pict_offsets;
+    pict_offsets.reserve(blorb_data.picts.size());
+    for (const auto &[id, _] : blorb_data.picts) {
+        pict_offsets.emplace(id, 0);
+    }
+
+    auto write_pict = [&](std::uint32_t id, const Chunk &chunk) {
+        pict_offsets.find(id)->second = out.size();
+        write_chunk(chunk.type, chunk.data, {id});
+    };
+
+    if (blorb_data.layout == Layout::locality) {
+        // Each APal image is followed by its replacements, in current
+        // palette order, and each replacement by its scaled variants.
+        std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> replacements;
+        std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> variants;
+        FlatSet<std::uint32_t> grouped;
+        for (const auto &entry : blorb_data.bpal) {
+            if (blorb_data.picts.contains(entry.id) && grouped.insert(entry.id).second) {
+                replacements[entry.requested].push_back(entry.id);
+            }
+        }
+        for (const auto &entry : blorb_data.scaled) {
+            if (blorb_data.picts.contains(entry.id) && grouped.insert(entry.id).second) {
+                variants[entry.replacement].push_back(entry.id);
+            }
+        }
+
+        auto write_group = [&](std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> &groups, std::uint32_t id, auto &&then) {
+            if (auto it = groups.find(id); it != groups.end()) {
+                for (const auto member : it->second) {
+                    write_pict(member, blorb_data.picts.at(member));
+                    then(member);
+                }
+            }
+        };
+
+        for (const auto &[id, chunk] : blorb_data.picts) {
+            if (grouped.contains(id)) {
+                continue;
+            }
+
+            write_pict(id, chunk);
+            write_group(replacements, id, [&](std::uint32_t replacement) {
+                write_group(variants, replacement, [](std::uint32_t) { });
+            });
+        }
+    } else {
+        for (const auto &[id, chunk] : blorb_data.picts) {
+            write_pict(id, chunk);
+        }
+    }
+
+    std::vector<std::size_t> offsets;
+    for (const auto &[_, offset] : pict_offsets) {
+        offsets.push_back(offset);
+    }
+
+    if (blorb_data.exec.has_value()) {
+        offsets.push_back(out.size());
+        write_chunk(TypeID("ZCOD"), *blorb_data.exec);
+    }
+
+    if (blorb_data.layout == Layout::ids) {
+        write_tables();
+    }
+
+    for (const auto &[i, offset] : std::views::enumerate(offsets)) {
+        patch32(0x20 + (i * 12), offset);
+    }
+
+    patch32(4, out.size() - 8);
+
+    BPAL_PROBE1(write__done, out.size());
+
+    return out;
+}
+
+struct DecodedPair {
+    QImage apal;
+    QList<QRgb> palette;
+};
+
+std::shared_ptr<const DecodedPair> decode_pair(std::span<const unsigned char> apal, std::span<const unsigned char> palette)
+{
+    return std::make_shared<const DecodedPair>(qimage_from_data(apal), palette_from_image(qimage_from_data(palette)));
+}
+
+Image replace(std::span<const unsigned char> apal, std::span<const unsigned char> palette, ImageFormat format)
+{
+    return replace(*decode_pair(apal, palette), format);
+}
+
+Image replace(const DecodedPair &pair, ImageFormat format)
+{
+    auto image = pair.apal;
+    apply_palette(image, pair.palette);
+
+    Image replacement{format, static_cast<std::uint32_t>(image.width()), static_cast<std::uint32_t>(image.height()), {}};
+
+    switch (format) {
+    case ImageFormat::png: {
+        QByteArray scratch;
+        auto png = save_png(image, scratch);
+        replacement.data.assign(png.begin(), png.end());
+        break;
+    }
+    case ImageFormat::argb32: {
+        // Lines are done one at a time, as QImage pads them.
+        std::size_t line = image.width() * 4;
+        replacement.data.resize(line * image.height());
+
+        if (image.format() == QImage::Format_Indexed8) {
+            blit::Palette palette{};
+            auto colors = image.colorTable();
+            std::ranges::copy(colors | std::views::take(palette.size()), palette.begin());
+            auto kernel = blit::best_kernel(colors.size());
+
+            for (int y = 0; y < image.height(); y++) {
+                auto out = reinterpret_cast<std::uint32_t *>(replacement.data.data() + (y * line));
+                blit::blit({image.constScanLine(y), static_cast<std::size_t>(image.width())}, palette, {out, static_cast<std::size_t>(image.width())}, kernel);
+            }
+        } else {
+            auto argb = image.convertToFormat(QImage::Format_ARGB32);
+            for (int y = 0; y < argb.height(); y++) {
+                std::memcpy(replacement.data.data() + (y * line), argb.constScanLine(y), line);
+            }
+        }
+        break;
+    }
+    }
+
+    return replacement;
+}
+
+LazyReplacements::LazyReplacements(std::span<const unsigned char> blorb, ImageFormat format, std::size_t max_bytes) :
+    m_blorb(parse(blorb)),
+    m_apal(find_apal_images(m_blorb.chunks)),
+    m_format(format),
+    m_max_bytes(max_bytes)
+{
+}
+
+std::shared_ptr<const Image> LazyReplacements::get(std::uint32_t current, std::uint32_t requested)
+{
+    auto apal = m_blorb.picts.find(requested);
+    auto palette = m_blorb.picts.find(current);
+    if (!m_apal.contains(requested) || m_apal.contains(current) ||
+        apal == m_blorb.picts.end() || palette == m_blorb.picts.end() ||
+        apal->second.type != TypeID("PNG ") || palette->second.type != TypeID("PNG ")) {
+        return nullptr;
+    }
+
+    auto key = (static_cast<std::uint64_t>(current) << 32) | requested;
+
+    {
+        std::lock_guard lock(m_mutex);
+
+        if (auto it = m_index.find(key); it != m_index.end()) {
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            m_stats.hits++;
+            return it->second->second;
+        }
+
+        m_stats.misses++;
+    }
+
+    // Converting outside the lock lets other threads use the cache in
+    // the meantime; two threads which miss on the same pair both
+    // convert it, and the first to finish wins.
+    auto image = std::make_shared<const Image>(replace(apal->second.data, palette->second.data, m_format));
+
+    std::lock_guard lock(m_mutex);
+
+    if (auto it = m_index.find(key); it != m_index.end()) {
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        return it->second->second;
+    }
+
+    m_lru.emplace_front(key, image);
+    m_index.emplace(key, m_lru.begin());
+    m_stats.bytes += image->data.size();
+
+    // The newest entry is always kept, even if it alone is over the
+    // limit.
+    while (m_stats.bytes > m_max_bytes && m_lru.size() > 1) {
+        auto &[old_key, old_image] = m_lru.back();
+        m_stats.bytes -= old_image->data.size();
+        m_stats.evictions++;
+        m_index.erase(old_key);
+        m_lru.pop_back();
+    }
+
+    m_stats.entries = m_lru.size();
+
+    return image;
+}
+
+LazyReplacements::Stats LazyReplacements::stats() const
+{
+    std::lock_guard lock(m_mutex);
+
+    return m_stats;
+}
+
+void LazyReplacements::clear()
+{
+    std::lock_guard lock(m_mutex);
+
+    m_lru.clear();
+    m_index.clear();
+    m_stats.bytes = 0;
+    m_stats.entries = 0;
+}
+
+namespace {
+
+// A Blorb file parsed and planned, by the stages of process() which do
+// not depend on an earlier run.
+struct Prepared {
+    BlorbData blorb_data;
+    Plan plan;
+    std::optional<ClusterReport> cluster_report;
+};
+
+}
+
+static Prepared prepare(std::span<const unsigned char> blorb, const JobOptions &options, Context &context)
+{
+    Prepared prepared{[&] {
+        StageTimer timer(context, Statistics::Stage::parse);
+        return parse(blorb);
+    }(), {}, std::nullopt};
+    auto &blorb_data = prepared.blorb_data;
+
+    if (options.exec.has_value()) {
+        blorb_data.exec.emplace(options.exec->begin(), options.exec->end());
+    }
+
+    auto &p = prepared.plan = [&] {
+        StageTimer timer(context, Statistics::Stage::discover);
+        return plan(blorb_data);
+    }();
+
+    if (options.prune && !blorb_data.exec.has_value()) {
+        context.status("Not pruning: no story file was given");
+    } else if (options.prune) {
+        auto drawable = drawable_pictures(*blorb_data.exec);
+        if (drawable.pictures.has_value()) {
+            auto all = p.pairs.size();
+            restrict_to_pictures(p, *drawable.pictures);
+            context.status(std::format("Story can draw {} of {} pairs", p.pairs.size(), all));
+        } else {
+            context.status(std::format("Not pruning: {}", drawable.reason));
+        }
+    }
+
+    if (!options.traces.empty()) {
+        auto all = p.pairs.size();
+        restrict_to_traces(p, options.traces);
+        context.status(std::format("Traces reach {} of {} pairs", p.pairs.size(), all));
+    }
+
+    if (options.cluster.has_value()) {
+        auto &cluster_report = prepared.cluster_report = cluster_palettes(p, blorb_data, context, *options.cluster);
+        context.status(std::format("{} pairs share {} replacements (threshold ΔE {:.2f}, largest error ΔE {:.2f}, estimated size {} bytes)",
+                    cluster_report->pairs, cluster_report->replacements, cluster_report->threshold, cluster_report->max_error, cluster_report->estimated_size));
+    }
+
+    return prepared;
+}
+
+static Output run(std::span<const unsigned char> blorb, const JobOptions &options, Context &context)
+{
+    auto prepared = prepare(blorb, options, context);
+    auto &blorb_data = prepared.blorb_data;
+    auto &p = prepared.plan;
+
+    MemoryScope input(context, Statistics::Memory::input, chunk_bytes(blorb_data));
+
+    if (options.previous.has_value() && options.previous_state.has_value()) {
+        // BlorbData cannot be assigned to (its chunks would outlive their
+        // arena), so it is constructed directly from parse().
+        auto previous = [&options, &context] {
+            StageTimer timer(context, Statistics::Stage::parse);
+
+            try {
+                return parse(*options.previous, true);
+            } catch (const Error &e) {
+                throw Error(std::format("previous output: {}", e.what()));
+            }
+        }();
+
+        MemoryScope previous_input(context, Statistics::Memory::input, chunk_bytes(previous));
+        reuse(p, context, previous, *options.previous_state);
+    }
+
+    blorb_data.table_format = options.table_format;
+    blorb_data.layout = options.layout;
+
+    if (options.replacements != Replacements::images) {
+        blorb_data.bplt = palette_entries(blorb_data, p, context);
+    }
+
+    Output output;
+    output.cluster_report = prepared.cluster_report;
+
+    if (options.replacements != Replacements::palettes) {
+        {
+            auto conversion = convert(blorb_data, p, context);
+            MemoryScope uncompressed(context, Statistics::Memory::uncompressed, conversion_bytes(conversion));
+            compress(blorb_data, conversion, context);
+            output.state = incremental_state(blorb_data, conversion);
+        }
+
+        if (!options.windows.empty()) {
+            auto scaled = scale(blorb_data, options.windows, context);
+            MemoryScope uncompressed(context, Statistics::Memory::uncompressed, conversion_bytes(scaled));
+            compress(blorb_data, scaled, context);
+        }
+    }
+
+    {
+        StageTimer timer(context, Statistics::Stage::write);
+        output.blorb = serialize(blorb_data, context.trace());
+    }
+
+    if (auto *statistics = context.statistics()) {
+        statistics->add_bytes(blorb.size(), output.blorb.size());
+    }
+
+    return output;
+}
+
+Output process(std::span<const unsigned char> blorb, const JobOptions &options, Context &context)
+{
+    auto output = [&] {
+        std::shared_lock running(context.jobs());
+        return run(blorb, options, context);
+    }();
+
+    context.trim_caches();
+
+    return output;
+}
+
+std::vector<unsigned char> process(std::span<const unsigned char> blorb, std::optional<std::span<const unsigned char>> exec, Context &context)
+{
+    JobOptions options;
+    options.exec = exec;
+
+    return process(blorb, options, context).blorb;
+}
+
+namespace {
+
+// The chunks holding the colors of an indexed PNG image, found without
+// decoding it; either is empty if absent.
+struct PngPalette {
+    std::span<const unsigned char> plte;
+    std::span<const unsigned char> trns;
+};
+
+PngPalette png_palette(std::span<const unsigned char> png)
+{
+    PngPalette palette;
+
+    for (std::size_t offset = 8; offset + 8 <= png.size(); ) {
+        auto size = be32(png[offset], png[offset + 1], png[offset + 2], png[offset + 3]);
+        auto type = be32(png[offset + 4], png[offset + 5], png[offset + 6], png[offset + 7]);
+
+        if (size > png.size() - offset - 8) {
+            throw Error("truncated PNG");
+        }
+
+        auto data = png.subspan(offset + 8, size);
+        if (type == TypeID("PLTE")) {
+            palette.plte = data;
+        } else if (type == TypeID("tRNS")) {
+            palette.trns = data;
+        } else if (type == TypeID("IDAT")) {
+            break;
+        }
+
+        offset += 12 + std::size_t(size);
+    }
+
+    return palette;
+}
+
+// A digest of the colors convert_palette() would apply from “palette”
+// to an image with “apal_colors” colors: its RGBA colors from index 2 on.
+Digest applied_colors(const PngPalette &palette, std::size_t apal_colors)
+{
+    std::vector<unsigned char> colors;
+    auto count = std::min(palette.plte.size() / 3, apal_colors);
+
+    for (std::size_t i = 2; i < count; i++) {
+        colors.insert(colors.end(), palette.plte.begin() + (i * 3), palette.plte.begin() + (i * 3) + 3);
+        colors.push_back(i < palette.trns.size() ? palette.trns[i] : 0xff);
+    }
+
+    return digest(colors);
+}
+
+}
+
+Estimate estimate(std::span<const unsigned char> blorb, const JobOptions &options, Context &context, const EstimateOptions &estimate_options)
+{
+    std::shared_lock running(context.jobs());
+    auto prepared = prepare(blorb, options, context);
+    const auto &blorb_data = prepared.blorb_data;
+    const auto &p = prepared.plan;
+
+    context.status("Estimating...");
+
+    std::vector<std::uint32_t> sources = p.sources;
+    if (sources.empty()) {
+        for (const auto &pair : p.pairs) {
+            sources.push_back(pair.first);
+        }
+    }
+
+    struct APalImage {
+        Digest digest;
+        std::size_t colors;
+    };
+
+    std::vector<APalImage> apal_images(p.apal.size());
+    context.pool().parallel_for(apal_images.size(), [&](std::size_t i) {
+        const auto &data = blorb_data.picts.at(*(p.apal.begin() + i)).data;
+        apal_images[i] = {digest(data), png_palette(data).plte.size() / 3};
+    });
+
+    // Pairs are deduplicated in order, as convert() does, but by what
+    // they are made from rather than by the converted image.
+    struct Unique {
+        std::size_t pair;
+        std::size_t apal_bytes;
+    };
+
+    std::vector<Unique> uniques;
+    std::unordered_map<Digest, std::size_t, DigestHash> by_signature;
+    std::unordered_map<std::uint32_t, PngPalette> palettes;
+    for (const auto &[i, pair] : std::views::enumerate(p.pairs)) {
+        auto apal_index = std::ranges::lower_bound(p.apal, pair.second) - p.apal.begin();
+        const auto &apal = apal_images[apal_index];
+
+        auto palette = palettes.find(sources[i]);
+        if (palette == palettes.end()) {
+            palette = palettes.emplace(sources[i], png_palette(blorb_data.picts.at(sources[i]).data)).first;
+        }
+
+        auto signature = combine(apal.digest, applied_colors(palette->second, apal.colors));
+        if (by_signature.try_emplace(signature, uniques.size()).second) {
+            uniques.emplace_back(i, blorb_data.picts.at(pair.second).data.size());
+        }
+    }
+
+    Estimate result;
+    result.pairs = p.pairs.size();
+    result.replacements = uniques.size();
+    result.samples = std::min(estimate_options.samples, uniques.size());
+
+    // Sampled replacements are converted in parallel, and then compressed
+    // at each preset one at a time, so that the process’s CPU time over
+    // each compression is that compression’s alone: it includes liboxi’s
+    // own threads, or the oxipng process without liboxi.
+    struct Sample {
+        std::size_t apal_bytes;
+        std::vector<unsigned char> converted;
+        std::vector<std::size_t> compressed_bytes;
+        std::vector<double> cpu_seconds;
+        std::vector<double> wall_seconds;
+    };
+
+    std::vector<Sample> samples(result.samples);
+    context.pool().parallel_for(samples.size(), [&](std::size_t s) {
+        const auto &unique = uniques[s * uniques.size() / samples.size()];
+        auto [source, apal_id] = std::pair(sources[unique.pair], p.pairs[unique.pair].second);
+        const auto &source_data = blorb_data.picts.at(source).data;
+        const auto &apal_data = blorb_data.picts.at(apal_id).data;
+
+        auto palette = decoded_palette(context, source, digest(source_data), source_data);
+        auto apal = decoded_apal(context, apal_id, digest(apal_data), apal_data);
+
+        QByteArray scratch;
+        auto converted = convert_palette(apal, *palette, scratch);
+
+        samples[s].apal_bytes = unique.apal_bytes;
+        samples[s].converted.assign(converted.begin(), converted.end());
+    });
+
+    for (auto &sample : samples) {
+        for (const auto preset : estimate_options.presets) {
+            auto start = std::chrono::steady_clock::now();
+            auto cpu_start = process_cpu_seconds();
+            sample.compressed_bytes.push_back(compress_png(sample.converted, preset).size());
+            sample.cpu_seconds.push_back(process_cpu_seconds() - cpu_start);
+            sample.wall_seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+
+    // Sampled sizes and times are scaled up by the APal image sizes of
+    // all replacements.
+    std::size_t apal_bytes = 0;
+    for (const auto &unique : uniques) {
+        apal_bytes += unique.apal_bytes;
+    }
+
+    double sampled_apal = 0;
+    double sampled_uncompressed = 0;
+    for (const auto &sample : samples) {
+        sampled_apal += sample.apal_bytes;
+        sampled_uncompressed += sample.converted.size();
+    }
+
+    double uncompressed = sampled_apal > 0 ? apal_bytes * (sampled_uncompressed / sampled_apal) : 0;
+    result.uncompressed_bytes = std::llround(uncompressed);
+
+    auto base = base_size(blorb_data, p.pairs.size()) + (uniques.size() * (12 + 8));
+    for (const auto &[j, preset] : std::views::enumerate(estimate_options.presets)) {
+        double compressed = 0;
+        double cpu = 0;
+        double wall = 0;
+        for (const auto &sample : samples) {
+            compressed += sample.compressed_bytes[j];
+            cpu += sample.cpu_seconds[j];
+            wall += sample.wall_seconds[j];
+        }
+
+        // process() compresses replacements on all of the pool’s threads
+        // at once.
+        auto scale = sampled_uncompressed > 0 ? uncompressed / sampled_uncompressed : 0;
+        auto threads = std::min<std::size_t>(context.pool().concurrency(), std::max<std::size_t>(1, uniques.size()));
+
+        result.presets.emplace_back(preset, std::llround(compressed * scale), base + std::llround(compressed * scale), cpu * scale, wall * scale / threads);
+    }
+
+    return result;
+}
+
+}
@@ -0,0 +1,892 @@
+#ifndef BPAL_LIBBPAL_H
+#define BPAL_LIBBPAL_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "bpix.h"
+#include "bplt.h"
+#include "flat_map.h"
+#include "thread_pool.h"
+
+// libbpal: generate BPal chunks for Blorb files entirely in memory.
+//
+// A Blorb is processed in stages, each of which is exposed so that
+// callers can inspect or adjust intermediate results:
+//
+//     parse      Blorb file contents to BlorbData
+//     plan       find APal images and the (palette, APal) pairs to convert
+//     convert    apply palettes and deduplicate the resulting images
+//     compress   compress the new images and add them, with BPal entries
+//     serialize  BlorbData to Blorb file contents
+//
+// process() runs all of them. Stages which do heavy lifting take a
+// Context, which holds a worker pool and caches; a Context is meant to
+// be created once and reused for any number of Blorbs.
+namespace bpal {
+
+class Error : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+constexpr std::uint32_t be32(unsigned char a, unsigned char b, unsigned char c, unsigned char d)
+{
+    return (static_cast<std::uint32_t>(a) << 24) |
+           (static_cast<std::uint32_t>(b) << 16) |
+           (static_cast<std::uint32_t>(c) <<  8) |
+           (static_cast<std::uint32_t>(d) <<  0);
+}
+
+constexpr std::uint32_t TypeID(const char (&id)[5])
+{
+    return be32(id[0], id[1], id[2], id[3]);
+}
+
+std::string idstr(std::uint32_t id);
+
+// Chunk payloads are allocated from arenas which are released all at
+// once, instead of each payload being a separate heap allocation.
+using Bytes = std::pmr::vector<unsigned char>;
+
+struct Chunk {
+    std::uint32_t type;
+    Bytes data;
+};
+
+struct BPalEntry {
+    std::uint32_t palette;
+    std::uint32_t requested;
+    std::uint32_t id;
+};
+
+// A replacement pre-scaled for a window of width×height pixels, written
+// as a BPsc chunk (see Blorb.md).
+struct ScaledEntry {
+    std::uint32_t width;
+    std::uint32_t height;
+    std::uint32_t replacement;
+    std::uint32_t id;
+};
+
+// How serialize() writes BPal entries: as a BPal chunk, as a dense BPIx
+// matrix (see Blorb.md), or both.
+enum class TableFormat {
+    list,
+    matrix,
+    both,
+};
+
+// The order in which serialize() writes chunks. With “ids”, pictures are
+// written in ID order and the BPal table comes last. With “locality”,
+// Reso, APal and the BPal table come right after the resource index, and
+// each APal image is followed by its replacements, so that interpreters
+// reading ranges of the file, or prefetching a memory map, touch fewer
+// pages.
+enum class Layout {
+    ids,
+    locality,
+};
+
+struct BlorbData {
+    // Backs all chunks (including newly created ones), and lives as long
+    // as the Blorb data itself.
+    std::unique_ptr<std::pmr::monotonic_buffer_resource> arena = std::make_unique<std::pmr::monotonic_buffer_resource>();
+    std::vector<Chunk> chunks;
+    std::optional<std::vector<unsigned char>> exec;
+    FlatMap<std::uint32_t, Chunk, std::pmr::vector<std::pair<std::uint32_t, Chunk>>> picts{arena.get()};
+    std::vector<BPalEntry> bpal;
+    TableFormat table_format = TableFormat::list;
+    Layout layout = Layout::ids;
+
+    // Palette-only replacements, written as a BPlt chunk.
+    std::vector<bplt::Entry> bplt;
+
+    // Pre-scaled replacements, written as a BPsc chunk.
+    std::vector<ScaledEntry> scaled;
+
+    // Converted IDs start at 1000, unless the Blorb file contains
+    // larger IDs, at which point the converted IDs start at the largest
+    // ID plus one.
+    std::uint32_t next_id = 1000;
+};
+
+// A SHA-256 content hash, used to key caches by image contents. Equal
+// digests are taken to mean equal contents, across jobs, server clients
+// and incremental runs, without comparing the images themselves, so the
+// hash must be one for which a collision cannot be found, even on
+// purpose.
+struct Digest {
+    std::array<unsigned char, 32> bytes;
+
+    auto operator<=>(const Digest &) const = default;
+};
+
+struct DigestHash {
+    std::size_t operator()(const Digest &digest) const {
+        std::size_t hash;
+        std::memcpy(&hash, digest.bytes.data(), sizeof(hash));
+        return hash;
+    }
+};
+
+Digest digest(std::span<const unsigned char> data);
+
+// The replacement images to generate for a Blorb.
+struct Plan {
+    FlatSet<std::uint32_t> apal;
+    std::vector<std::uint32_t> palettes;
+
+    // (current palette, APal image) pairs, grouped by current palette,
+    // in the order their BPal entries will be written.
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> pairs;
+
+    // IDs to give replacement images, keyed by the digest of the
+    // converted image, so that an incremental rebuild keeps the IDs of
+    // an earlier run (see reuse()).
+    std::unordered_map<Digest, std::uint32_t, DigestHash> preferred_ids;
+
+    // If not empty, the palette image whose colors are applied for each
+    // pair, in place of the pair’s own current palette (see
+    // cluster_palettes()).
+    std::vector<std::uint32_t> sources;
+};
+
+// Converted, deduplicated, but not yet compressed, replacement images.
+struct Conversion {
+    // Backs the images, and is released once they are compressed.
+    std::unique_ptr<std::pmr::monotonic_buffer_resource> arena = std::make_unique<std::pmr::monotonic_buffer_resource>();
+
+    // Unique images, in ID order. An image which is already in the
+    // Context’s compressed cache might not have been converted, in which
+    // case its data is empty.
+    std::vector<std::uint32_t> ids;
+    std::vector<std::span<const unsigned char>> images;
+    std::vector<Digest> digests;
+
+    std::vector<BPalEntry> bpal;
+
+    // The palette image whose colors each BPal entry’s replacement was
+    // made with; this is the entry’s current palette, unless clustering
+    // chose another.
+    std::vector<std::uint32_t> sources;
+
+    // Scaled variants of replacements (see scale()).
+    std::vector<ScaledEntry> scaled;
+};
+
+// A thread-safe map from content digests to values. Entries are only
+// removed by evict(), erase_if() and clear().
+template <typename T>
+class DigestCache {
+public:
+    using value_type = T;
+
+    std::optional<T> find(const Digest &digest) const {
+        std::lock_guard lock(m_mutex);
+        auto it = m_entries.find(digest);
+        if (it == m_entries.end()) {
+            return std::nullopt;
+        }
+
+        it->second.used = ++m_clock;
+        return it->second.value;
+    }
+
+    // Returns the cached value, which is an existing one if another
+    // thread got there first.
+    T insert(const Digest &digest, T value) {
+        return emplace(digest, std::move(value)).first;
+    }
+
+    // As insert(), also returning whether “value” was the one inserted.
+    std::pair<T, bool> emplace(const Digest &digest, T value) {
+        std::lock_guard lock(m_mutex);
+        auto [it, inserted] = m_entries.try_emplace(digest, std::move(value), 0);
+        it->second.used = ++m_clock;
+
+        return {it->second.value, inserted};
+    }
+
+    std::size_t size() const {
+        std::lock_guard lock(m_mutex);
+
+        return m_entries.size();
+    }
+
+    // The sum of “f” over all values.
+    template <typename F>
+    std::size_t sum(F &&f) const {
+        std::lock_guard lock(m_mutex);
+        std::size_t total = 0;
+
+        for (const auto &[_, entry] : m_entries) {
+            total += f(entry.value);
+        }
+
+        return total;
+    }
+
+    // Remove the least recently found or inserted entries until the sum
+    // of “f” over the rest is at most “budget”. Returns the number of
+    // entries removed and the sum of “f” over them.
+    template <typename F>
+    std::pair<std::size_t, std::size_t> evict(std::size_t budget, F &&f) {
+        std::lock_guard lock(m_mutex);
+        std::vector<std::pair<std::uint64_t, Digest>> order;
+        std::size_t total = 0;
+
+        for (const auto &[digest, entry] : m_entries) {
+            order.emplace_back(entry.used, digest);
+            total += f(entry.value);
+        }
+
+        std::ranges::sort(order);
+
+        std::size_t removed = 0;
+        std::size_t freed = 0;
+        for (auto it = order.begin(); total - freed > budget && it != order.end(); ++it) {
+            auto entry = m_entries.find(it->second);
+            freed += f(entry->second.value);
+            m_entries.erase(entry);
+            removed++;
+        }
+
+        return {removed, freed};
+    }
+
+    // Remove the entries whose values “f” is true for, returning how
+    // many were removed.
+    template <typename F>
+    std::size_t erase_if(F &&f) {
+        std::lock_guard lock(m_mutex);
+
+        return std::erase_if(m_entries, [&f](const auto &item) { return f(item.second.value); });
+    }
+
+    void clear() {
+        std::lock_guard lock(m_mutex);
+        m_entries.clear();
+    }
+
+private:
+    struct Entry {
+        T value;
+
+        // The value of m_clock when the entry was last used; find()
+        // updates it, although it does not otherwise change the cache.
+        mutable std::uint64_t used;
+    };
+
+    mutable std::mutex m_mutex;
+    mutable std::uint64_t m_clock = 0;
+    std::unordered_map<Digest, Entry, DigestHash> m_entries;
+};
+
+using ContentCache = DigestCache<std::shared_ptr<const std::vector<unsigned char>>>;
+
+// Decoded images, keyed by the digest of their chunks. This is internal
+// to the library, which keeps Qt types out of this header.
+struct DecodedImages;
+
+struct CacheStats {
+    std::size_t compressed;
+    std::size_t replacements;
+    std::size_t apal_images;
+    std::size_t palettes;
+};
+
+// Timings, sizes and memory use collected while processing, for build dashboards
+// and regression tracking. One object can be shared by any number of
+// jobs and threads, and accumulates over all of them.
+class Statistics {
+public:
+    // Decoding happens within convert, and dedup within convert's worker
+    // threads, so their times are also counted in convert's.
+    enum class Stage {
+        parse,
+        discover,
+        decode,
+        convert,
+        dedup,
+        compress,
+        write,
+    };
+
+    static constexpr std::size_t stages = 7;
+
+    // Times are in seconds. For stages run on worker threads (decode and
+    // dedup), wall time is summed over threads, and CPU time is that of
+    // the threads; otherwise CPU time is that of the whole process.
+    struct Time {
+        double wall = 0;
+        double cpu = 0;
+        std::size_t count = 0;
+    };
+
+    // What memory is held for, as far as bpal can tell; buffers private
+    // to Qt or oxipng are not included.
+    enum class Memory {
+        // Chunks of the Blorbs being processed (and of previous output,
+        // for incremental builds).
+        input,
+
+        // APal images and current palette color tables, in the Context’s
+        // cache.
+        decoded,
+
+        // Converted replacements, from conversion until compression.
+        uncompressed,
+
+        // Compressed replacements, in the Context’s cache.
+        compressed,
+
+        // Digests keying the Context’s caches, and the converted image
+        // digests the replacements cache maps them to.
+        keys,
+    };
+
+    static constexpr std::size_t memory_categories = 5;
+
+    // The process’s peak resident set size in bytes at the end of a
+    // stage, and how much the stage raised it. Stages run on worker
+    // threads (decode and dedup) are not measured, so as not to add a
+    // system call per image or pair.
+    struct Rss {
+        std::size_t peak = 0;
+        std::size_t growth = 0;
+    };
+
+    // Live and peak bytes of a Memory category.
+    struct Usage {
+        std::size_t live = 0;
+        std::size_t peak = 0;
+    };
+
+    void add_time(Stage stage, double wall, double cpu);
+
+    // The peak resident set size was “before” bytes when “stage” began,
+    // and “after” when it ended.
+    void add_rss(Stage stage, std::size_t before, std::size_t after);
+
+    void add_bytes(std::size_t in, std::size_t out);
+
+    // “bytes” more (or, if negative, fewer) are held for “category”.
+    void add_memory(Memory category, std::ptrdiff_t bytes);
+
+    // “pairs” replacements were made, of which “unique” were distinct.
+    void add_dedup(std::size_t pairs, std::size_t unique);
+
+    // An image was compressed from “before” to “after” bytes.
+    void add_compressed(std::size_t before, std::size_t after, double seconds);
+
+    std::string json() const;
+
+private:
+    mutable std::mutex m_mutex;
+    std::array<Time, stages> m_times{};
+    std::array<Rss, stages> m_rss{};
+    std::array<Usage, memory_categories> m_memory{};
+    Usage m_memory_total;
+    std::size_t m_bytes_in = 0;
+    std::size_t m_bytes_out = 0;
+    std::size_t m_pairs = 0;
+    std::size_t m_unique = 0;
+    std::size_t m_compressed_in = 0;
+    std::size_t m_compressed_out = 0;
+    std::vector<double> m_ratios;
+    std::vector<double> m_latencies;
+};
+
+// The pictures a Trace event concerns: the picture itself and, for
+// palette conversions, the current palette image whose colors were
+// applied.
+struct TracePictures {
+    std::optional<std::uint32_t> picture = std::nullopt;
+    std::optional<std::uint32_t> palette = std::nullopt;
+};
+
+// A timeline of the work done while processing, in the Chrome trace
+// event format, for viewing in Perfetto or chrome://tracing. Each stage,
+// and each decode, palette conversion, cache lookup, compression and
+// chunk write, is an event on the thread which did it, tagged with the
+// pictures involved. Like Statistics, one object can be shared by any
+// number of jobs and threads.
+class Trace {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Pictures = TracePictures;
+
+    // Record an event which began at “start” and ends now. “name” must
+    // be a string literal, or otherwise outlive the Trace.
+    void add(const char *name, Clock::time_point start, Pictures pictures = {});
+
+    std::string json() const;
+
+private:
+    struct Event {
+        const char *name;
+        Clock::time_point start;
+        Clock::time_point end;
+        std::size_t thread;
+        Pictures pictures;
+    };
+
+    Clock::time_point m_origin = Clock::now();
+    mutable std::mutex m_mutex;
+    std::vector<Event> m_events;
+
+    // Threads are numbered in order of their first event.
+    std::unordered_map<std::thread::id, std::size_t> m_threads;
+};
+
+// How far compression has got, reported to Options::progress.
+struct Progress {
+    std::size_t images = 0;
+    std::size_t total_images = 0;
+
+    // Uncompressed bytes of the images done, and of all images; images
+    // found in the compressed cache without being converted count as
+    // empty.
+    std::size_t bytes = 0;
+    std::size_t total_bytes = 0;
+
+    // Uncompressed less compressed bytes, over the images done.
+    std::ptrdiff_t saved = 0;
+};
+
+struct Options {
+    // Total number of threads to use, including the calling thread;
+    // zero means one per hardware thread.
+    unsigned int threads = 0;
+
+    // If not zero, the most bytes of compressed and decoded images the
+    // Context’s caches keep between jobs. After a job, once no other job
+    // is running, the least recently used images are evicted to fit;
+    // decoded images go first, as they are cheaper to make again.
+    std::size_t cache_limit = 0;
+
+    // Called with a short description as each stage starts.
+    std::function<void(std::string_view)> status;
+
+    // Called as compression starts, and as each image is compressed or
+    // found in the cache. Calls come from worker threads, but never more
+    // than one at a time, so should be quick.
+    std::function<void(const Progress &)> progress;
+
+    // If set, timings and sizes are added to it; it must outlive the
+    // Context.
+    Statistics *statistics = nullptr;
+
+    // If set, events are added to it; it must outlive the Context.
+    Trace *trace = nullptr;
+};
+
+class Context {
+public:
+    explicit Context(Options options = {});
+    ~Context();
+
+    Context(const Context &) = delete;
+    Context &operator=(const Context &) = delete;
+
+    const Options &options() const { return m_options; }
+    ThreadPool &pool() { return m_pool; }
+
+    // Compressed images keyed by the digest of their uncompressed form.
+    ContentCache &compressed() { return m_compressed; }
+
+    // Digests of converted images, keyed by the combined digests of the
+    // APal and current palette images they were made from. Since the
+    // key depends only on image contents, the same artwork appearing in
+    // different Blorbs is converted only once per Context.
+    DigestCache<Digest> &replacements() { return m_replacements; }
+
+    // Decoded APal images, and the color tables of current palette
+    // images, so that a long-lived Context does not need to decode an
+    // image again when only some of the pairs it is part of change.
+    DecodedImages &decoded() { return *m_decoded; }
+
+    CacheStats cache_stats() const;
+
+    void status(std::string_view message) const;
+
+    Statistics *statistics() const { return m_options.statistics; }
+    Trace *trace() const { return m_options.trace; }
+
+    // Held, shared, by each job while it runs, so that clear_caches()
+    // and trim_caches() wait for a moment when no job needs the cached
+    // images it found.
+    std::shared_mutex &jobs() { return m_jobs; }
+
+    // Empty the caches, once no job is running; so this must not be
+    // called from within a job, as from a status or progress callback.
+    void clear_caches();
+
+    // Evict cached images beyond Options::cache_limit, unless a job is
+    // running; process() calls this after each job.
+    void trim_caches();
+
+private:
+    Options m_options;
+    std::shared_mutex m_jobs;
+    ContentCache m_compressed;
+    DigestCache<Digest> m_replacements;
+    std::unique_ptr<DecodedImages> m_decoded;
+    ThreadPool m_pool;
+};
+
+// A record of what a run produced, written alongside its output so that
+// the next run can rebuild incrementally: replacements whose APal and
+// current palette images are unchanged are taken from the earlier
+// output, keeping their IDs, and only pairs involving a changed image
+// are converted and compressed again.
+struct IncrementalState {
+    // Digests of the APal and current palette image chunks.
+    struct Input {
+        std::uint32_t id;
+        Digest digest;
+    };
+
+    // Digests of each replacement, before and after compression.
+    struct Replacement {
+        std::uint32_t id;
+        Digest converted;
+        Digest compressed;
+    };
+
+    std::vector<Input> inputs;
+    std::vector<Replacement> replacements;
+    std::vector<BPalEntry> pairs;
+};
+
+std::string format_incremental_state(const IncrementalState &state);
+IncrementalState parse_incremental_state(std::string_view text);
+
+// Parse a Blorb file. Unless “generated” is set, the file must not
+// already have a BPal chunk or an Exec resource; when it is set, as for
+// reading bpal’s own output, both are loaded.
+BlorbData parse(std::span<const unsigned char> blorb, bool generated = false);
+FlatSet<std::uint32_t> find_apal_images(std::span<const Chunk> chunks);
+Plan plan(const BlorbData &blorb_data);
+
+// The picture numbers an interpreter plotted, in order, as recorded
+// during a playthrough. In text form, numbers are separated by
+// whitespace, and “#” starts a comment which runs to the end of the line.
+using DrawTrace = std::vector<std::uint32_t>;
+
+DrawTrace parse_draw_trace(std::string_view text);
+
+// Drop the pairs of “plan” which none of “traces” reaches, following the
+// “Current Palette” rules: drawing a palette image makes it current, and
+// drawing an APal image while a palette is current uses that pair. Each
+// trace starts with no current palette.
+void restrict_to_traces(Plan &plan, std::span<const DrawTrace> traces);
+
+struct DrawablePictures {
+    // The pictures the story can draw, unless that cannot be determined.
+    std::optional<FlatSet<std::uint32_t>> pictures;
+
+    // If it cannot, why not.
+    std::string reason;
+};
+
+// The pictures which a Z-machine story file can draw, found by scanning
+// its high memory for draw_picture instructions with constant picture
+// operands. Since data can look like code, the result may include
+// pictures which are never drawn, but never misses one. Gives no
+// pictures if that cannot be guaranteed: if the story is not for version
+// 6, or if any draw_picture takes its picture number from a variable, as
+// one which looks up pictures in a table does. Byte sequences whose
+// operand types could not belong to a draw_picture are not taken for
+// one.
+DrawablePictures drawable_pictures(std::span<const unsigned char> story);
+
+// Drop the pairs of “plan” whose palette or APal image is not in
+// “pictures”.
+void restrict_to_pictures(Plan &plan, const FlatSet<std::uint32_t> &pictures);
+
+struct ClusterOptions {
+    // The largest color difference (CIE76 ΔE; about 2.3 is just
+    // noticeable) between palettes which may share a replacement.
+    double threshold = 0;
+
+    // If set, the threshold is instead the smallest for which the output
+    // is estimated to fit in this many bytes.
+    std::optional<std::size_t> target_size;
+};
+
+struct ClusterReport {
+    double threshold;
+    std::size_t pairs;
+    std::size_t replacements;
+
+    // The largest color difference introduced in any replacement.
+    double max_error;
+
+    // Replacements are estimated to be as large as their APal images.
+    std::size_t estimated_size;
+
+    // False if ClusterOptions::target_size was given, but no threshold
+    // brings the estimated size within it; the largest threshold is then
+    // used.
+    bool target_met;
+};
+
+// Lossy: let pairs share a replacement when their current palettes are
+// alike, comparing only the entries which the APal image uses. For each
+// APal image, palettes are taken in pair order, and each either joins the
+// first earlier palette within the threshold, or starts a new cluster;
+// pairs then use the colors of the palette which started their cluster.
+// Fills in plan.sources, so this must be the last change to plan.pairs.
+ClusterReport cluster_palettes(Plan &plan, const BlorbData &blorb_data, Context &context, const ClusterOptions &options);
+
+// Prepare “plan” and “context” to reuse the replacements in “previous”,
+// the output of an earlier run, which wrote “state”. Replacements whose
+// chunks no longer match the state are ignored.
+void reuse(Plan &plan, Context &context, const BlorbData &previous, const IncrementalState &state);
+
+Conversion convert(const BlorbData &blorb_data, const Plan &plan, Context &context);
+
+// The colors which each pair’s replacement would substitute into its APal
+// image, for a BPlt chunk.
+std::vector<bplt::Entry> palette_entries(const BlorbData &blorb_data, const Plan &plan, Context &context);
+
+void compress(BlorbData &blorb_data, const Conversion &conversion, Context &context);
+
+struct WindowSize {
+    std::uint32_t width;
+    std::uint32_t height;
+};
+
+// The contents of a Reso chunk (Blorb specification, §7.2).
+struct Resolution {
+    struct Ratio {
+        std::uint32_t numerator;
+        std::uint32_t denominator;
+    };
+
+    struct Entry {
+        Ratio standard;
+        Ratio min;
+        Ratio max;
+    };
+
+    WindowSize standard;
+    WindowSize min;
+    WindowSize max;
+    FlatMap<std::uint32_t, Entry> entries;
+
+    // The factor by which an interpreter scales picture “id” in a window
+    // of size “window”: the window is clamped to the limits, the elbow
+    // room factor is the smaller of its ratios to the standard window
+    // size, and this multiplied by the picture’s standard ratio is then
+    // clamped to its limits. Pictures without an entry are not scaled.
+    double ratio(std::uint32_t id, WindowSize window) const;
+};
+
+Resolution parse_resolution(std::span<const unsigned char> chunk);
+
+// Replacements pre-scaled for each of “windows” (see ScaledEntry), using
+// the ratios in the Blorb’s Reso chunk for the APal image each replaces.
+// Images which would not change size are skipped, as are images replacing
+// APal images which would scale them to different sizes, and images with
+// the same scaled size are shared between windows. Run after compress(); the
+// result is then compressed in turn.
+Conversion scale(const BlorbData &blorb_data, std::span<const WindowSize> windows, Context &context);
+
+// Describe the replacements which “conversion” added to “blorb_data”.
+IncrementalState incremental_state(const BlorbData &blorb_data, const Conversion &conversion);
+
+// If “trace” is set, each chunk written is added to it.
+std::vector<unsigned char> serialize(const BlorbData &blorb_data, Trace *trace = nullptr);
+
+// Which forms of replacement to generate: full images, listed in a BPal
+// chunk; palettes, in a BPlt chunk; or both.
+enum class Replacements {
+    images,
+    palettes,
+    both,
+};
+
+struct JobOptions {
+    // Bundled as a ZCOD Exec resource, if provided.
+    std::optional<std::span<const unsigned char>> exec;
+
+    // For incremental rebuilds: the output of an earlier run, and the
+    // state written along with it.
+    std::optional<std::span<const unsigned char>> previous;
+    std::optional<IncrementalState> previous_state;
+
+    // If not empty, only the pairs reached by these traces are generated.
+    std::span<const DrawTrace> traces;
+
+    // Skip pairs involving pictures which “exec” cannot draw, if that can
+    // be determined (see drawable_pictures()).
+    bool prune = false;
+
+    // If set, cluster similar palettes (see cluster_palettes()).
+    std::optional<ClusterOptions> cluster;
+
+    Replacements replacements = Replacements::images;
+    TableFormat table_format = TableFormat::list;
+    Layout layout = Layout::ids;
+
+    // If not empty, replacements are also written pre-scaled for each of
+    // these window sizes (see scale()).
+    std::span<const WindowSize> windows;
+};
+
+struct Output {
+    std::vector<unsigned char> blorb;
+    IncrementalState state;
+    std::optional<ClusterReport> cluster_report;
+};
+
+// On-demand replacements, for interpreters which would rather load an
+// unmodified Blorb file and convert only the pairs that are plotted.
+enum class ImageFormat {
+    // PNG, as written before compression by process().
+    png,
+
+    // Rows of 32-bit pixels, 0xAARRGGBB in native byte order, without
+    // padding.
+    argb32,
+};
+
+struct Image {
+    ImageFormat format;
+    std::uint32_t width;
+    std::uint32_t height;
+    std::vector<unsigned char> data;
+};
+
+// Apply the palette of the current palette image “palette” to the APal
+// image “apal” (both PNG files), exactly as a BPal replacement would.
+Image replace(std::span<const unsigned char> apal, std::span<const unsigned char> palette, ImageFormat format);
+
+// An APal image and the colors of a current palette image, decoded once
+// so that the palette can be applied repeatedly, as when timing that on
+// its own. This is internal to the library, which keeps Qt types out of
+// this header.
+struct DecodedPair;
+
+std::shared_ptr<const DecodedPair> decode_pair(std::span<const unsigned char> apal, std::span<const unsigned char> palette);
+
+// As replace(), without the decoding.
+Image replace(const DecodedPair &pair, ImageFormat format);
+
+// Replacements for the pairs of one Blorb file, made on first use and
+// kept in a cache holding up to “max_bytes” of image data, from which the
+// least recently used are evicted. This is safe to use from several
+// threads at once.
+class LazyReplacements {
+public:
+    // “blorb” is an unmodified Blorb file, which is copied.
+    LazyReplacements(std::span<const unsigned char> blorb, ImageFormat format, std::size_t max_bytes);
+
+    // The replacement for “requested” when “current” is the current
+    // palette image, or null if the pair has none (because “requested”
+    // is not an APal image, or “current” is not a palette image).
+    std::shared_ptr<const Image> get(std::uint32_t current, std::uint32_t requested);
+
+    struct Stats {
+        std::size_t hits = 0;
+        std::size_t misses = 0;
+        std::size_t evictions = 0;
+        std::size_t entries = 0;
+        std::size_t bytes = 0;
+    };
+
+    Stats stats() const;
+
+    void clear();
+
+private:
+    using Entry = std::pair<std::uint64_t, std::shared_ptr<const Image>>;
+
+    BlorbData m_blorb;
+    FlatSet<std::uint32_t> m_apal;
+    ImageFormat m_format;
+    std::size_t m_max_bytes;
+
+    mutable std::mutex m_mutex;
+    std::list<Entry> m_lru;
+    std::unordered_map<std::uint64_t, std::list<Entry>::iterator> m_index;
+    Stats m_stats;
+};
+
+// Run all stages, returning a copy of “blorb” with a BPal chunk.
+Output process(std::span<const unsigned char> blorb, const JobOptions &options, Context &context);
+std::vector<unsigned char> process(std::span<const unsigned char> blorb, std::optional<std::span<const unsigned char>> exec, Context &context);
+
+struct EstimateOptions {
+    // How many replacements to convert and compress, spread evenly over
+    // all of them.
+    std::size_t samples = 8;
+
+    // oxipng optimization levels to estimate compression for; process()
+    // uses 6.
+    std::vector<int> presets = {0, 1, 2, 3, 4, 5, 6};
+};
+
+// A prediction of the work process() would do and the output it would
+// write.
+struct Estimate {
+    struct Preset {
+        int level;
+        std::size_t compressed_bytes;
+        std::size_t output_bytes;
+
+        // Compression time over all replacements: the CPU time of the
+        // process and any oxipng processes, and the elapsed time with
+        // replacements compressed on each of the Context’s threads. Both
+        // are measured with the samples compressed one at a time, so
+        // other jobs sharing the Context inflate them.
+        double cpu_seconds;
+        double wall_seconds;
+    };
+
+    std::size_t pairs;
+
+    // Pairs whose APal image and applied colors are both the same make
+    // the same replacement, so this is found without converting
+    // anything. It can be slightly more than process() would make, as
+    // different colors applied to entries no pixel uses make no
+    // difference.
+    std::size_t replacements;
+    std::size_t samples;
+
+    // Converted replacements before compression.
+    std::size_t uncompressed_bytes;
+
+    std::vector<Preset> presets;
+};
+
+// Parse “blorb” and plan its replacements as process() would, and
+// estimate their size and compression time from a sample. Previous
+// output, pre-scaled and palette-only replacements are not taken into
+// account.
+Estimate estimate(std::span<const unsigned char> blorb, const JobOptions &options, Context &context, const EstimateOptions &estimate_options = {});
+
+}
+
+#endif
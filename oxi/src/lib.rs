@@ -10,7 +10,18 @@ pub struct CompressedPNG {
 /// the returned struct must be freed with C’s “free” function.
 #[no_mangle]
 pub unsafe extern "C" fn optimize_png(data: *const u8, size: libc::size_t) -> CompressedPNG {
-    let options = oxipng::Options::from_preset(6);
+    optimize_png_preset(data, size, 6)
+}
+
+/// As optimize_png(), with “preset” an oxipng optimization level, from 0
+/// to 6.
+///
+/// # Safety
+///
+/// As for optimize_png().
+#[no_mangle]
+pub unsafe extern "C" fn optimize_png_preset(data: *const u8, size: libc::size_t, preset: u8) -> CompressedPNG {
+    let options = oxipng::Options::from_preset(preset);
 
     let data_slice: &[u8] = std::slice::from_raw_parts(data, size);
 
@@ -0,0 +1,42 @@
+#ifndef BPAL_PROBES_H
+#define BPAL_PROBES_H
+
+// Static tracepoints (USDT) for observing bpal in production with
+// bpftrace, perf or SystemTap, without rebuilding:
+//
+//     bpftrace -e 'usdt:./bpal:bpal:compress__done { @[arg0] = arg2; }'
+//
+// Each operation has a “start” probe on entry and a “done” probe on
+// exit, fired on the thread doing the work:
+//
+//     parse__start(bytes)                  parse__done(bytes, pictures)
+//     decode__start(id, bytes)             decode__done(id, width, height)
+//     convert__start(apal, palette)        convert__done(apal, palette, bytes)
+//     dedup__start(apal, palette)          dedup__done(apal, palette, unique)
+//     compress__start(id, bytes)           compress__done(id, bytes, compressed bytes)
+//     write__start(chunks)                 write__done(bytes)
+//
+// With <sys/sdt.h> (from systemtap-sdt-dev or systemtap-sdt-devel),
+// each probe is a single nop until a tracer attaches. Without it, or
+// when built with BPAL_NO_PROBES, probes compile to nothing.
+
+#if !defined(BPAL_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BPAL_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef BPAL_HAVE_PROBES
+#define BPAL_PROBE1(name, a) DTRACE_PROBE1(bpal, name, a)
+#define BPAL_PROBE2(name, a, b) DTRACE_PROBE2(bpal, name, a, b)
+#define BPAL_PROBE3(name, a, b, c) DTRACE_PROBE3(bpal, name, a, b, c)
+#else
+// Arguments are named, but never evaluated, so that variables used only
+// by probes do not trigger warnings.
+#define BPAL_PROBE1(name, a) do { (void)sizeof(a); } while (0)
+#define BPAL_PROBE2(name, a, b) do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define BPAL_PROBE3(name, a, b, c) do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#endif
+
+#endif
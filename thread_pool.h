@@ -0,0 +1,142 @@
+#ifndef BPAL_THREAD_POOL_H
+#define BPAL_THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads, meant to be created once and shared by
+// every job in a process. Work is submitted with parallel_for, which may
+// be called from several threads at once: each call gets its own
+// completion state, and the calling thread takes part in the work, so a
+// call never waits on helpers which haven’t started yet.
+class ThreadPool {
+public:
+    // The pool runs “workers” threads in addition to each thread calling
+    // parallel_for; zero workers means everything runs on the caller.
+    explicit ThreadPool(unsigned int workers) {
+        for (unsigned int i = 0; i < workers; i++) {
+            m_workers.emplace_back([this] { run(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stop = true;
+        }
+
+        m_cv.notify_all();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // The number of threads which a single parallel_for can use.
+    unsigned int concurrency() const {
+        return m_workers.size() + 1;
+    }
+
+    // Call fn(i) for each i in [0, n), returning once all calls have
+    // finished. If any call throws, remaining indices are skipped and the
+    // first exception is rethrown here.
+    template <typename Fn>
+    void parallel_for(std::size_t n, Fn &&fn) {
+        struct State {
+            std::atomic<std::size_t> next = 0;
+            std::atomic<bool> failed = false;
+            std::size_t done = 0;
+            std::exception_ptr error;
+            std::mutex mutex;
+            std::condition_variable cv;
+        };
+
+        auto state = std::make_shared<State>();
+
+        // fn is only called for indices below n, and this function does
+        // not return until all such calls are done, so a helper which
+        // starts after the work has run out never touches fn.
+        auto work = [state, n, &fn] {
+            for (std::size_t i; (i = state->next++) < n; ) {
+                std::exception_ptr error;
+
+                if (!state->failed) {
+                    try {
+                        fn(i);
+                    } catch (...) {
+                        error = std::current_exception();
+                        state->failed = true;
+                    }
+                }
+
+                std::lock_guard lock(state->mutex);
+                if (error && !state->error) {
+                    state->error = error;
+                }
+                if (++state->done == n) {
+                    state->cv.notify_all();
+                }
+            }
+        };
+
+        auto helpers = std::min<std::size_t>(m_workers.size(), n > 0 ? n - 1 : 0);
+        if (helpers > 0) {
+            {
+                std::lock_guard lock(m_mutex);
+                for (std::size_t i = 0; i < helpers; i++) {
+                    m_queue.emplace_back(work);
+                }
+            }
+
+            m_cv.notify_all();
+        }
+
+        work();
+
+        std::unique_lock lock(state->mutex);
+        state->cv.wait(lock, [&state, n] { return state->done == n; });
+
+        if (state->error) {
+            std::rethrow_exception(state->error);
+        }
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::function<void()>> m_queue;
+    bool m_stop = false;
+
+    // Declared last so that the threads are joined before anything they
+    // use is destroyed.
+    std::vector<std::jthread> m_workers;
+
+    void run() {
+        for (;;) {
+            std::function<void()> task;
+
+            {
+                std::unique_lock lock(m_mutex);
+                m_cv.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+                if (m_queue.empty()) {
+                    return;
+                }
+
+                task = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+
+            task();
+        }
+    }
+};
+
+#endif